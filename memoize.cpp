@@ -1,5 +1,4 @@
 // TODO
-// - Support function call expressions
 // - Optimize caching and evaluation algorithm for cases where all the 
 //   children of a parent have the same set of inputs.  In this case, the 
 //   children don't need to be cached because it will never be used.  This is 
@@ -20,10 +19,48 @@
 
 #include "stdafx.h"
 
+#ifndef MEMOIZE_LITE
 #include <boost/proto/proto.hpp>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define MEMOIZE_HAS_COROUTINES 1
+#include <coroutine>
+#include <exception>
+#include <variant>
+#endif
+
+// The lightweight backend (memoize::lite) needs C++17.  Defining MEMOIZE_LITE 
+// builds only the lightweight backend, without Boost.Proto, with a demo main 
+// of its own, or the benchmark if MEMOIZE_BENCHMARK is also defined.
+#if defined(__cpp_fold_expressions) && defined(__cpp_if_constexpr)
+#define MEMOIZE_HAS_LITE 1
+#endif
+
+#if defined(MEMOIZE_LITE) && !defined(MEMOIZE_HAS_LITE)
+#error MEMOIZE_LITE requires C++17
+#endif
+
+#ifndef MEMOIZE_LITE
+
 namespace proto = boost::proto;
 namespace mpl = boost::mpl;
 namespace fusion = boost::fusion;
@@ -31,9 +68,65 @@ namespace fusion = boost::fusion;
 namespace memoize
 {
 
-    template <typename Expr> struct memoize;
+    struct mark_dirty_context;
     struct eval_cache_context;
 
+    // The compile-time choices made for the nodes of an expression.  To change 
+    // some of them, derive from default_policies and redefine those members, 
+    // then apply the result with with_policies<>().
+    // 
+    // same() decides whether an input has changed since its value was cached.
+    // 
+    // flag_type holds a node's dirty flag, and must be assignable from and 
+    // convertible to bool.
+    // 
+    // recompute<Tag, T> is a cost hint: when true, an operator or eager function 
+    // call with tag Tag and result type T doesn't cache its result, but 
+    // recomputes it from its children's results whenever it is read, because 
+    // that costs less than storing and copying the result (see recompute_cheap).  
+    // The node then has no result storage, and produces its result by value.
+    // 
+    // result_storage<T>::type holds a node's cached result of type T, and must 
+    // be default constructible, assignable from T and convertible to T const&.  
+    // Nodes that update their result in place (elementwise(), filter() and 
+    // fn_into() calls) need it to be T.
+    // 
+    // mark_context and eval_context are the contexts that reevaluate() uses for 
+    // its two passes.  Every node of the expression is visited with them, so a 
+    // context that derives from basic_mark_context<Derived, EvalContext> or 
+    // basic_eval_context<Derived, MarkContext>, naming itself as Derived, sees 
+    // each node and can redefine its nested eval for the nodes it handles.  
+    // Branches and lazy arguments are marked, and stale-while-revalidate jobs 
+    // evaluated, with default-constructed contexts of the types each one names.  
+    // Result types are still computed with eval_cache_context, so a derived 
+    // eval context must produce the same result for every node.
+    struct default_policies
+    {
+        template <typename T>
+        static bool same(T const& cached, T const& current)
+        {
+            return cached == current;
+        }
+
+        typedef bool flag_type;
+
+        template <typename Tag, typename T>
+        struct recompute : std::false_type
+        {
+        };
+
+        template <typename T>
+        struct result_storage
+        {
+            typedef T type;
+        };
+
+        typedef mark_dirty_context mark_context;
+        typedef eval_cache_context eval_context;
+    };
+
+    template <typename Expr, typename Policies = default_policies> struct memoize;
+
     // This is a wrapper class that allows a some object to be used as input to a 
     // memoized expression.  The type T must be DefaultConstructible, 
     // EqualityComparable and Copyable.  Use in() for convenience.
@@ -58,191 +151,4963 @@ namespace memoize
     template <typename T>
     input<T> in(T& t) { return input<T>(t); }
 
-    struct memoize_domain
-        : proto::domain < proto::generator<memoize> >
+    // Change detection policies for in(value, policy), which decide whether 
+    // the value has changed enough since it was last used to make the input 
+    // dirty.  A policy provides same(cached, current).
+
+    // Changes of at most epsilon are ignored.
+    struct within
     {
-        // The memoize domain customizes as_child so that expressions are held by 
-        // value.  This allows expression objects to be passed around or stored as
-        // class member data.
+        double epsilon;
+
         template <typename T>
-        struct as_child
-            : proto_base_domain::as_expr < T >
+        bool same(T const& cached, T const& current) const
         {
-        };
+            return std::abs(current - cached) <= epsilon;
+        }
     };
 
-    template <typename Expr>
-    struct memoize
-        : proto::extends < Expr, memoize<Expr>, memoize_domain >
+    // Changes of at most epsilon times the larger magnitude are ignored.
+    struct within_relative
     {
-        typedef proto::extends<Expr, memoize<Expr>, memoize_domain> base_type;
-        typedef typename proto::result_of::eval<memoize<Expr>, eval_cache_context const>::type cache_type;
+        double epsilon;
 
-        memoize(Expr const& expr = Expr()) : base_type(expr), dirty(true) {}
+        template <typename T>
+        bool same(T const& cached, T const& current) const
+        {
+            return std::abs(current - cached) <= epsilon * std::max(std::abs(cached), std::abs(current));
+        }
+    };
 
-        mutable cache_type result;
+    // Changes within the same multiple of step are ignored.
+    struct quantized
+    {
+        double step;
 
-        // Fix me: This flag is only meaningful for non-terminals. Terminal 
-        // dirtiness is determined by operator== on the source data.  I think a 
-        // custom generator could be used to provide an alternate memoize 
-        // implementation for terminals.
-        mutable bool dirty;
+        template <typename T>
+        bool same(T const& cached, T const& current) const
+        {
+            return std::floor(cached / step) == std::floor(current / step);
+        }
     };
 
-    template <typename T>
-    struct is_terminal : mpl::false_ {};
+    template <typename T, typename Policy>
+    struct approximate
+    {
+        T& value;
+        Policy policy;
+    };
 
-    template <typename T>
-    struct is_terminal<input<T> > : mpl::true_{};
+    // Input that is only dirty when its source has changed by more than its 
+    // policy allows, e.g. in(x, within{ 0.01 }).  The cache keeps the value 
+    // last used, rather than following the source, so that small changes can't 
+    // add up unnoticed.
+    template <typename T, typename Policy>
+    struct input<approximate<T, Policy> >
+    {
+        approximate<T, Policy> src;
+        mutable T cache;
+        mutable bool primed;
 
-    BOOST_PROTO_DEFINE_OPERATORS(is_terminal, memoize_domain);
+        input(T& source, Policy const& policy) : src{ source, policy }, cache(), primed(false)
+        {
+        }
+    };
 
-    // This context marks dirty all sub-expressions who depend on terminals 
-    // that are dirty.
-    struct mark_dirty_context
+    template <typename T, typename Policy>
+    typename std::enable_if<!std::is_member_pointer<Policy>::value, input<approximate<T, Policy> > >::type
+        in(T& t, Policy const& policy)
     {
-        template <
-            typename Expr,
-            typename Tag = typename proto::tag_of<Expr>::type>
-        struct eval
-            : proto::default_eval < Expr, mark_dirty_context const >
+        return input<approximate<T, Policy> >(t, policy);
+    }
+
+    // Input from a unique_ptr, which can't be copied.  Instead of the pointee's 
+    // value, the input caches its address, so it is only dirty when the 
+    // unique_ptr is reset to a different object.  Changes made through the 
+    // pointer aren't seen.  The expression is passed the unique_ptr itself.
+    template <typename T, typename D>
+    struct input<std::unique_ptr<T, D> >
+    {
+        std::unique_ptr<T, D>& src;
+        mutable typename std::unique_ptr<T, D>::pointer cache;
+
+        input(std::unique_ptr<T, D>& source) : src(source), cache()
         {
-            typedef bool result_type;
+        }
+    };
 
-            result_type operator()(Expr& e, mark_dirty_context const& ctx)
-            {
-                // If it has already been marked dirty (this condition ocurrs normally 
-                // before any evaluation has taken place), no need to look further.
-                if (e.dirty) return e.dirty;
+    // The recent changes to a sequence, each recorded as a splice that replaced 
+    // some number of elements at a position with some number of new ones, so 
+    // that readers can update in proportion to the number of changed elements 
+    // rather than the sequence's size.  The log is trimmed once it grows longer 
+    // than the sequence or than max_length, after which readers that haven't 
+    // caught up start over.
+    class change_log
+    {
+    public:
+        static const std::size_t max_length = 1024;
 
-                // Mark child expressions, and if any are dirty mark this expression as 
-                // dirty too.
-                return e.dirty = fusion::fold(e, false,
-                    std::bind(std::logical_or<bool>(), std::placeholders::_1,
-                    std::bind(proto::functional::eval(), std::placeholders::_2, ctx)));
-            }
-        };
+        change_log() : _version(0), _log_start(0)
+        {
+        }
 
-        template <typename Expr>
-        struct eval < Expr, proto::tag::terminal >
+        // Incremented by every change.
+        unsigned version() const { return _version; }
+
+        // Calls f(first, removed, inserted) for each change made after the 
+        // given version, in order.  Each change replaced removed elements at 
+        // first with inserted new ones.  Returns false, without calling f, if 
+        // the log no longer goes back that far.
+        template <typename F>
+        bool changes_since(unsigned version, F f) const
         {
-            typedef bool result_type;
+            if (version < _log_start) return false;
+            // The versions in the log are consecutive, so the first change after 
+            // version is found by its index.
+            for (std::size_t i = _log.empty() ? 0 : version + 1 - _log.front().version; i < _log.size(); ++i)
+                f(_log[i].first, _log[i].removed, _log[i].inserted);
+            return true;
+        }
 
-            result_type operator()(Expr& e, mark_dirty_context const&)
+        void record(std::size_t first, std::size_t removed, std::size_t inserted, std::size_t size)
+        {
+            _log.push_back(change{ ++_version, first, removed, inserted });
+            while (_log.size() > 16 && (_log.size() > size || _log.size() > max_length))
             {
-                auto& value = proto::value(e);
-                return e.dirty = !(value.cache == value.src);
+                _log_start = _log.front().version;
+                _log.pop_front();
             }
+        }
+
+    private:
+        struct change
+        {
+            unsigned version;
+            std::size_t first, removed, inserted;
         };
+
+        std::deque<change> _log;
+        unsigned _version;
+        unsigned _log_start;
     };
 
-    // This context evalutes an expression by re-evaluating any sub-expressions 
-    // that are dirty, and returning the cached result.
-    struct eval_cache_context
+    // A vector that keeps a change_log of what is done to it.  Elements may only 
+    // be changed through the members below.
+    template <typename T>
+    class tracked_vector
     {
-        template <
-            typename Expr,
-            typename Tag = typename proto::tag_of<Expr>::type>
-        struct eval
-            : proto::default_eval < Expr, eval_cache_context const >
+    public:
+        typedef T value_type;
+        typedef typename std::vector<T>::const_reference const_reference;
+        typedef typename std::vector<T>::const_iterator const_iterator;
+
+        std::size_t size() const { return _items.size(); }
+        bool empty() const { return _items.empty(); }
+        const_reference operator[](std::size_t i) const { return _items[i]; }
+        const_iterator begin() const { return _items.begin(); }
+        const_iterator end() const { return _items.end(); }
+
+        void set(std::size_t i, T value)
+        {
+            _items[i] = std::move(value);
+            changed(i, 1, 1);
+        }
+
+        // Returns a reference through which element i may be changed, until 
+        // the next change to the vector.
+        T& modify(std::size_t i)
+        {
+            changed(i, 1, 1);
+            return _items[i];
+        }
+
+        void push_back(T value)
+        {
+            _items.push_back(std::move(value));
+            changed(_items.size() - 1, 0, 1);
+        }
+
+        void pop_back()
+        {
+            _items.pop_back();
+            changed(_items.size(), 1, 0);
+        }
+
+        void insert(std::size_t i, T value)
+        {
+            _items.insert(_items.begin() + i, std::move(value));
+            changed(i, 0, 1);
+        }
+
+        void erase(std::size_t i)
+        {
+            _items.erase(_items.begin() + i);
+            changed(i, 1, 0);
+        }
+
+        void resize(std::size_t size, T const& value = T())
+        {
+            const std::size_t old_size = _items.size();
+            _items.resize(size, value);
+            const std::size_t common = std::min(size, old_size);
+            changed(common, old_size - common, size - common);
+        }
+
+        unsigned version() const { return _log.version(); }
+
+        template <typename F>
+        bool changes_since(unsigned version, F f) const
+        {
+            return _log.changes_since(version, f);
+        }
+
+    private:
+        void changed(std::size_t first, std::size_t removed, std::size_t inserted)
+        {
+            _log.record(first, removed, inserted, _items.size());
+        }
+
+        std::vector<T> _items;
+        change_log _log;
+    };
+
+    // Input from a tracked_vector.  Rather than a copy, the input remembers the 
+    // version it last saw, and the expression is passed the tracked_vector 
+    // itself, so that nodes can ask it what changed.
+    template <typename T>
+    struct input<tracked_vector<T> >
+    {
+        tracked_vector<T>& src;
+        mutable unsigned version;
+
+        input(tracked_vector<T>& source) : src(source), version(0)
+        {
+        }
+    };
+
+    // A view of a vector that is written directly rather than through a 
+    // tracked_vector, such as a pixel buffer, which finds what changed by 
+    // hashing the vector in blocks.  Each rehash() records the changed runs of 
+    // blocks in a change_log, so readers can recompute just those ranges.  T 
+    // must be TriviallyCopyable; blocks are compared by a 64-bit hash of their 
+    // bytes, so a change that collides is missed.
+    template <typename T>
+    class hashed_array
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "hashed_array<T> requires a trivially copyable T");
+
+    public:
+        typedef T value_type;
+        typedef T const& const_reference;
+
+        hashed_array(std::vector<T> const& source, std::size_t block_size)
+            : _source(&source), _block_size(block_size ? block_size : 1), _size(0)
+        {
+        }
+
+        std::size_t size() const { return _size; }
+        T const* data() const { return _source->data(); }
+        const_reference operator[](std::size_t i) const { return (*_source)[i]; }
+
+        unsigned version() const { return _log.version(); }
+
+        template <typename F>
+        bool changes_since(unsigned version, F f) const
+        {
+            return _log.changes_since(version, f);
+        }
+
+        // Compares the source's blocks with their hashes from the last call, 
+        // and records the ones that changed.  Returns whether any did.
+        bool rehash()
         {
-            typedef proto::default_eval<Expr, eval_cache_context const> base_type;
+            std::vector<T> const& items = *_source;
+            const std::size_t size = items.size();
+            const std::size_t common = std::min(size, _size);
+            const std::size_t old_blocks = _hashes.size();
+            const unsigned version = _log.version();
 
-            typename base_type::result_type operator()(Expr& e, eval_cache_context const& ctx)
+            _hashes.resize((size + _block_size - 1) / _block_size);
+            std::size_t run_first = 0, run_last = 0;
+            for (std::size_t b = 0; b < _hashes.size(); ++b)
             {
-                if (e.dirty)
+                const std::size_t first = b * _block_size;
+                const std::size_t last = std::min(first + _block_size, size);
+                const std::uint64_t hash = hash_bytes(items.data() + first, (last - first) * sizeof(T));
+                if (b < old_blocks && hash == _hashes[b]) continue;
+                _hashes[b] = hash;
+
+                // Coalesce adjacent changed blocks within the common prefix.
+                if (first >= common) continue;
+                if (first != run_last)
                 {
-                    e.result = base_type::operator()(e, ctx);
-                    e.dirty = false;
+                    if (run_first != run_last) record(run_first, run_last - run_first, size);
+                    run_first = first;
                 }
-                return e.result;
+                run_last = std::min(last, common);
             }
-        };
-
-        template <
-            typename Expr,
-            typename Value = typename proto::result_of::value<Expr>::type>
-        struct eval_terminal;
+            if (run_first != run_last) record(run_first, run_last - run_first, size);
+            if (size != _size) _log.record(common, _size - common, size - common, size);
+            _size = size;
+            return _log.version() != version;
+        }
 
-        template <typename Expr, typename T>
-        struct eval_terminal < Expr, input<T> >
+    private:
+        void record(std::size_t first, std::size_t count, std::size_t size)
         {
-            typedef T result_type;
+            _log.record(first, count, count, size);
+        }
 
-            result_type& operator()(Expr& e, eval_cache_context const&)
+        // FNV-1a.
+        static std::uint64_t hash_bytes(void const* data, std::size_t length)
+        {
+            std::uint64_t hash = 14695981039346656037ull;
+            for (std::size_t i = 0; i < length; ++i)
             {
-                auto& value = proto::value(e);
-                value.cache = value.src;
-                e.dirty = false;
-                return value.cache;
+                hash ^= static_cast<unsigned char const*>(data)[i];
+                hash *= 1099511628211ull;
             }
-        };
+            return hash;
+        }
 
-        template <typename Expr>
-        struct eval <Expr, proto::tag::terminal>
-            : eval_terminal < Expr >
+        std::vector<T> const* _source;
+        std::size_t _block_size;
+        std::size_t _size;
+        std::vector<std::uint64_t> _hashes;
+        change_log _log;
+    };
+
+    // Input from a vector that is written directly, with in_blocks().  The 
+    // expression is passed the hashed_array, from which nodes such as 
+    // transform() and sum(), or called functions, can find the changed ranges.
+    template <typename T>
+    struct input<hashed_array<T> >
+    {
+        mutable hashed_array<T> cache;
+
+        input(std::vector<T> const& source, std::size_t block_size) : cache(source, block_size)
         {
-        };
+        }
     };
 
-    template <typename Expr>
-    typename proto::result_of::eval<Expr, eval_cache_context const>::type
-        reevaluate(memoize<Expr> const& e)
+    // The default block size is a 4 KiB page of elements.
+    template <typename T>
+    input<hashed_array<T> > in_blocks(std::vector<T> const& source, std::size_t block_size = 4096 / sizeof(T))
     {
-        proto::eval(e, mark_dirty_context());
-        return proto::eval(e, eval_cache_context());
+        return input<hashed_array<T> >(source, block_size);
     }
 
-    struct renderer
+    // The input only points to the vector, so it can't be a temporary.
+    template <typename T>
+    input<hashed_array<T> > in_blocks(std::vector<T> const&& source, std::size_t block_size = 4096 / sizeof(T)) = delete;
+
+    // The most recent samples of a stream, up to a fixed capacity.  push() is 
+    // O(1), overwriting the oldest sample once the buffer is full.  Samples 
+    // are numbered in the order they were pushed, and the total count serves 
+    // as the buffer's version.
+    template <typename T>
+    class ring_buffer
     {
-        std::function<void()> _f;
+    public:
+        typedef T value_type;
+        typedef T const& const_reference;
 
-        template <typename Expr>
-        renderer& operator=(Expr& e)
+        explicit ring_buffer(std::size_t capacity) : _slots(capacity ? capacity : 1), _count(0)
         {
-            proto::display_expr(e);
-            _f = [=]() { reevaluate(e); };
-            return *this;
         }
 
-        void operator()()
+        void push(T value)
         {
-            if (_f) _f();
+            _slots[_count % _slots.size()] = std::move(value);
+            ++_count;
         }
+
+        std::size_t capacity() const { return _slots.size(); }
+        std::size_t size() const { return static_cast<std::size_t>(std::min<unsigned long long>(_count, _slots.size())); }
+
+        // The number of samples ever pushed.
+        unsigned long long count() const { return _count; }
+
+        // The i-th oldest sample still held.
+        const_reference operator[](std::size_t i) const { return sample(_count - size() + i); }
+
+        // Sample number n, which must still be held.
+        const_reference sample(unsigned long long n) const { return _slots[n % _slots.size()]; }
+
+    private:
+        std::vector<T> _slots;
+        unsigned long long _count;
     };
 
-    struct ui_element
+    // Input from a ring_buffer, which is dirty whenever a sample has been pushed.  
+    // The expression is passed the ring_buffer itself.
+    template <typename T>
+    struct input<ring_buffer<T> >
     {
-        int i1, i2, i3;
-        renderer _renderer;
+        ring_buffer<T>& src;
+        mutable unsigned long long count;
 
-        ui_element()
+        input(ring_buffer<T>& source) : src(source), count(0)
         {
-            _renderer = (in(i1) + in(i2) + in(i3));
-            i1 = 1;
-            i2 = 11;
-            i3 = 111;
         }
+    };
 
-        void render() { _renderer(); }
+    // A value that one writer thread may store() while other threads load() 
+    // it, without locking either side.  Each store() bumps a sequence number 
+    // around the write, and load() retries until it copies the value without 
+    // a store() in progress, so readers always see a value that was stored as 
+    // a whole.  Stores from more than one thread must be serialized by the 
+    // caller.  The type T must be TriviallyCopyable.
+    template <typename T>
+    class seqlock
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "seqlock<T> requires a trivially copyable T");
+
+        typedef std::uintptr_t word;
+        static const std::size_t word_count = (sizeof(T) + sizeof(word) - 1) / sizeof(word);
+
+    public:
+        seqlock(T const& value = T()) : _sequence(0)
+        {
+            write(value);
+        }
+
+        void store(T const& value)
+        {
+            const unsigned sequence = _sequence.load(std::memory_order_relaxed);
+            _sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            write(value);
+            _sequence.store(sequence + 2, std::memory_order_release);
+        }
+
+        T load() const
+        {
+            unsigned version;
+            return load(version);
+        }
+
+        // Returns the value, and the version() it was stored with.
+        T load(unsigned& version) const
+        {
+            word words[word_count];
+            for (;;)
+            {
+                version = _sequence.load(std::memory_order_acquire);
+                if (version & 1) continue;
+
+                for (std::size_t i = 0; i < word_count; ++i)
+                    words[i] = _words[i].load(std::memory_order_relaxed);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (_sequence.load(std::memory_order_relaxed) == version) break;
+            }
+
+            T value;
+            std::memcpy(&value, words, sizeof(T));
+            return value;
+        }
+
+        // Changes every time a value is stored.
+        unsigned version() const
+        {
+            return _sequence.load(std::memory_order_acquire);
+        }
+
+    private:
+        void write(T const& value)
+        {
+            word words[word_count] = {};
+            std::memcpy(words, &value, sizeof(T));
+            for (std::size_t i = 0; i < word_count; ++i)
+                _words[i].store(words[i], std::memory_order_relaxed);
+        }
+
+        std::atomic<unsigned> _sequence;
+        std::atomic<word> _words[word_count];
     };
-}
 
-int main(int argc, char* argv[])
-{
-    int a, b, c;
+    // Input from a seqlock, so that the source may be written by another thread 
+    // while the expression is evaluated.  mark_dirty_context takes a snapshot of 
+    // the source if its version changed, and eval_cache_context evaluates with 
+    // that snapshot, so a single evaluation sees one consistent value even if 
+    // the source is stored again in between.
+    template <typename T>
+    struct input<seqlock<T> >
+    {
+        seqlock<T>& src;
+        mutable T cache;
+        mutable T snapshot;
+        mutable unsigned version;
 
-    proto::display_expr(proto::as_expr(memoize::in(a))(1));
+        // Versions are always even, so the first snapshot always loads.
+        input(seqlock<T>& source) : src(source), cache(), snapshot(), version(1)
+        {
+        }
+    };
 
-    memoize::ui_element e;
+    // Identifies the evaluation in progress on the calling thread.  Each call to 
+    // reevaluate() starts a new evaluation with an id that is unique across 
+    // threads, so that state shared between terminals can be refreshed once per 
+    // evaluation.
+    inline unsigned& current_evaluation()
+    {
+        static thread_local unsigned id = 0;
+        return id;
+    }
 
-    e.render();
-    e.render();
+    inline unsigned new_evaluation()
+    {
+        static std::atomic<unsigned> last(0);
+        return current_evaluation() = ++last;
+    }
 
-    e.i2 += 5;
+    // Writes to several members of a seqlock<T> that are published together.  
+    // Nothing is visible to readers until commit(), which stores all of the 
+    // changes at once, and an uncommitted transaction is discarded.
+    template <typename T>
+    class transaction
+    {
+    public:
+        explicit transaction(seqlock<T>& target) : _target(target), _value(target.load())
+        {
+        }
 
-    e.render();
+        T& operator*() { return _value; }
+        T* operator->() { return &_value; }
+
+        void commit() { _target.store(_value); }
+
+    private:
+        seqlock<T>& _target;
+        T _value;
+    };
+
+    // The evaluating thread's view of a seqlock<T> whose members are used as 
+    // separate inputs, with in(group, &T::member).  The group takes at most one 
+    // snapshot per evaluation, so all of its inputs see the same transaction, 
+    // and while the source's version is unchanged each input is clean after a 
+    // single comparison.
+    template <typename T>
+    class input_group
+    {
+    public:
+        explicit input_group(seqlock<T>& source)
+            : _source(source), _snapshot(), _version(1), _evaluation(0)
+        {
+        }
 
+        // Returns the snapshot for the current evaluation.  Versions are always 
+        // even, so the first call always loads.
+        T const& snapshot() const
+        {
+            if (_evaluation != current_evaluation() || (_version & 1))
+            {
+                _evaluation = current_evaluation();
+                if (_source.version() != _version)
+                    _snapshot = _source.load(_version);
+            }
+            return _snapshot;
+        }
+
+        // The version of the snapshot.  Only meaningful after snapshot().
+        unsigned version() const { return _version; }
+
+    private:
+        seqlock<T>& _source;
+        mutable T _snapshot;
+        mutable unsigned _version;
+        mutable unsigned _evaluation;
+    };
+
+    template <typename T, typename M>
+    struct group_member
+    {
+        input_group<T>& group;
+        M T::* member;
+    };
+
+    // Input from a member of an input_group.  The input remembers the group 
+    // version its cache was taken from, so it only compares values when the 
+    // group has changed.
+    template <typename T, typename M>
+    struct input<group_member<T, M> >
+    {
+        group_member<T, M> src;
+        mutable M cache;
+        mutable unsigned version;
+
+        input(input_group<T>& group, M T::* member) : src{ group, member }, cache(), version(1)
+        {
+        }
+    };
+
+    template <typename T, typename M>
+    input<group_member<T, M> > in(input_group<T>& group, M T::* member)
+    {
+        return input<group_member<T, M> >(group, member);
+    }
+
+    template <typename Owner, typename T>
+    struct owner_member
+    {
+        mutable Owner const* owner;
+        T Owner::* member;
+    };
+
+    // Input from a member of the object that owns the expression, with 
+    // in(owner, &Owner::member).  Unlike in(owner.member), the binding doesn't 
+    // refer to the member's address, so when the owner is copied or moved its 
+    // expression can be pointed at the new object with rebind(), and objects 
+    // owning expressions can be kept by value in containers.
+    template <typename Owner, typename T>
+    struct input<owner_member<Owner, T> >
+    {
+        owner_member<Owner, T> src;
+        mutable T cache;
+
+        input(Owner const& owner, T Owner::* member) : src{ &owner, member }, cache()
+        {
+        }
+    };
+
+    template <typename Owner, typename T>
+    input<owner_member<Owner, T> > in(Owner const& owner, T Owner::* member)
+    {
+        return input<owner_member<Owner, T> >(owner, member);
+    }
+
+    // A fixed set of threads that run submitted jobs in submission order.  The 
+    // destructor runs any jobs still queued before joining the threads.
+    class worker_pool
+    {
+    public:
+        explicit worker_pool(unsigned thread_count = std::thread::hardware_concurrency())
+            : _stopping(false)
+        {
+            if (thread_count == 0) thread_count = 1;
+            for (unsigned i = 0; i < thread_count; ++i)
+                _threads.emplace_back([this]() { run(); });
+        }
+
+        ~worker_pool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stopping = true;
+            }
+            _wake.notify_all();
+            for (auto& thread : _threads) thread.join();
+        }
+
+        worker_pool(worker_pool const&) = delete;
+        worker_pool& operator=(worker_pool const&) = delete;
+
+        void submit(std::function<void()> job)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _jobs.push_back(std::move(job));
+            }
+            _wake.notify_one();
+        }
+
+    private:
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (;;)
+            {
+                _wake.wait(lock, [this]() { return _stopping || !_jobs.empty(); });
+                if (_jobs.empty()) return;
+
+                std::function<void()> job = std::move(_jobs.front());
+                _jobs.pop_front();
+                lock.unlock();
+                job();
+                lock.lock();
+            }
+        }
+
+        std::deque<std::function<void()> > _jobs;
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        bool _stopping;
+        std::vector<std::thread> _threads;
+    };
+
+    inline worker_pool& default_worker_pool()
+    {
+        static worker_pool pool;
+        return pool;
+    }
+
+    // This is a wrapper class that allows a callable object to be called from a 
+    // memoized expression.  The callable is never considered to have changed.  
+    // Use fn() for convenience, e.g. fn(f)(in(a), in(b)).
+    template <typename F>
+    struct function
+    {
+        F f;
+
+        function(F const& callable) : f(callable)
+        {
+        }
+    };
+
+    template <typename F>
+    std::ostream& operator<<(std::ostream& s, const function<F>& f)
+    {
+        s << "function";
+        return s;
+    }
+
+    // Like function, except that the callable writes the result into the 
+    // node's previous result, passed as its first argument, rather than 
+    // returning it.  A callable that reuses the previous result's storage, e.g. 
+    // by clear()ing a vector and appending to it, makes recomputation allocate 
+    // nothing once the result has reached its steady-state size.  R is the 
+    // result type, which must be DefaultConstructible.  Use fn_into<R>() for 
+    // convenience, e.g. 
+    // fn_into<std::string>([](std::string& out, int a) { out.assign(a, '*'); })(in(a)).
+    template <typename R, typename F>
+    struct into_function
+    {
+        typedef R result_type;
+
+        F f;
+
+        into_function(F const& callable) : f(callable)
+        {
+        }
+    };
+
+    template <typename R, typename F>
+    std::ostream& operator<<(std::ostream& s, const into_function<R, F>& f)
+    {
+        s << "into function";
+        return s;
+    }
+
+    // Like function, except that the callable is passed its arguments 
+    // unevaluated, as lazy_arg objects, and evaluates only the ones it needs by 
+    // calling get().  The call records which arguments were read during its last 
+    // evaluation, and depends only on those.  Use lazy() for convenience, e.g. 
+    // lazy([](auto a, auto b) { return a.get() ? b.get() : 0; })(in(x), in(y)).
+    template <typename F>
+    struct lazy_function
+    {
+        F f;
+
+        lazy_function(F const& callable) : f(callable)
+        {
+        }
+    };
+
+    template <typename F>
+    std::ostream& operator<<(std::ostream& s, const lazy_function<F>& f)
+    {
+        s << "lazy function";
+        return s;
+    }
+
+    // Whether a terminal holding a T is a constant, such as the 2 in 
+    // in(x) * 2, which never changes and so is never dirty.  Every terminal is 
+    // a constant except inputs and callees.
+    template <typename T>
+    struct is_constant : std::true_type {};
+
+    template <typename T>
+    struct is_constant<input<T> > : std::false_type {};
+
+    template <typename F>
+    struct is_constant<function<F> > : std::false_type {};
+
+    template <typename R, typename F>
+    struct is_constant<into_function<R, F> > : std::false_type {};
+
+    template <typename F>
+    struct is_constant<lazy_function<F> > : std::false_type {};
+
+    // Selects how a terminal holding a T is marked and evaluated: as 
+    // constant_terminal<T> if it is a constant, otherwise as T.
+    template <typename T>
+    struct constant_terminal {};
+
+    template <typename T>
+    struct terminal_kind
+        : mpl::if_ < is_constant<T>, constant_terminal<T>, T >
+    {
+    };
+
+    // The value held by the terminal that is called by a function call 
+    // expression.
+    template <typename Expr>
+    struct callee_of
+        : std::decay < typename proto::result_of::value<
+            typename proto::result_of::child_c<Expr, 0>::type>::type >
+    {
+    };
+
+    // Tag of the node built by stale(), which serves its previous result while 
+    // its child is re-evaluated on a worker_pool.
+    struct stale_while_revalidate {};
+
+    inline std::ostream& operator<<(std::ostream& s, stale_while_revalidate)
+    {
+        s << "stale_while_revalidate";
+        return s;
+    }
+
+    // Tag of the nodes built by sum(), count_if(), minimum() and maximum(), 
+    // which reduce a container with Op.
+    template <typename Op>
+    struct aggregate {};
+
+    template <typename Op>
+    std::ostream& operator<<(std::ostream& s, aggregate<Op>)
+    {
+        s << "aggregate";
+        return s;
+    }
+
+    // Tag of the nodes built by moving_sum(), moving_average(), moving_min() 
+    // and moving_max(), which reduce the last samples of a ring_buffer.
+    template <typename Kind>
+    struct windowed {};
+
+    template <typename Kind>
+    std::ostream& operator<<(std::ostream& s, windowed<Kind>)
+    {
+        s << "windowed";
+        return s;
+    }
+
+    // Tags of the nodes built by transform() and filter(), which keep a value 
+    // for each element of a container.
+    struct mapped {};
+    struct filtered {};
+
+    inline std::ostream& operator<<(std::ostream& s, mapped)
+    {
+        s << "mapped";
+        return s;
+    }
+
+    inline std::ostream& operator<<(std::ostream& s, filtered)
+    {
+        s << "filtered";
+        return s;
+    }
+
+    // Tag of the node built by cached<K>(), which remembers the results of its 
+    // child for the K most recently used combinations of the child's operands.
+    template <std::size_t K>
+    struct lru {};
+
+    template <std::size_t K>
+    std::ostream& operator<<(std::ostream& s, lru<K>)
+    {
+        s << "lru<" << K << ">";
+        return s;
+    }
+
+    // Tag of the node built by shared(), whose result is looked up in a table 
+    // shared by every instance of the same expression type.
+    struct shared_result {};
+
+    inline std::ostream& operator<<(std::ostream& s, shared_result)
+    {
+        s << "shared_result";
+        return s;
+    }
+
+    // Tag of the node built by elementwise(), which evaluates an element-wise 
+    // expression over containers in a single loop.
+    struct fused {};
+
+    inline std::ostream& operator<<(std::ostream& s, fused)
+    {
+        s << "fused";
+        return s;
+    }
+
+    // Tag of the node built by profile(), which measures how often its child is 
+    // read and recomputed, and how long recomputing it takes.
+    struct profiled {};
+
+    inline std::ostream& operator<<(std::ostream& s, profiled)
+    {
+        s << "profiled";
+        return s;
+    }
+
+    // Calls to lazy functions are evaluated differently from other function 
+    // calls, so call_tag gives them their own tag for the purpose of selecting 
+    // how a node is marked and evaluated.  Every other node is selected by its 
+    // proto tag.
+    struct lazy_call {};
+
+    // Calls to into_functions are also given their own tag.
+    struct into_call {};
+
+    template <typename Expr, typename Tag = typename proto::tag_of<Expr>::type>
+    struct node_tag
+    {
+        typedef Tag type;
+    };
+
+    template <typename Callee>
+    struct call_tag
+    {
+        typedef proto::tag::function type;
+    };
+
+    template <typename F>
+    struct call_tag < lazy_function<F> >
+    {
+        typedef lazy_call type;
+    };
+
+    template <typename R, typename F>
+    struct call_tag < into_function<R, F> >
+    {
+        typedef into_call type;
+    };
+
+    template <typename Expr>
+    struct node_tag < Expr, proto::tag::function >
+        : call_tag < typename callee_of<Expr>::type >
+    {
+    };
+
+    // Whether an expression is a built-in operator whose operands are all 
+    // constants, so that it can be folded into a constant.
+    template <typename Expr>
+    struct is_foldable;
+
+    // The node that memoize_generator makes of an expression: the expression 
+    // itself, or for a foldable expression, a constant holding its value.
+    template <typename Expr, typename Policies, bool Foldable = is_foldable<Expr>::value>
+    struct generated
+    {
+        typedef memoize<Expr, Policies> type;
+
+        static type make(Expr const& e)
+        {
+            return type(e);
+        }
+    };
+
+    template <typename Expr, typename Policies>
+    struct generated < Expr, Policies, true >
+    {
+        typedef typename std::decay<typename proto::result_of::eval<
+            Expr const, proto::default_context const>::type>::type value_type;
+        typedef memoize<proto::basic_expr<proto::tag::terminal, proto::term<value_type>, 0>, Policies> type;
+
+        static type make(Expr const& e)
+        {
+            return type(proto::basic_expr<proto::tag::terminal, proto::term<value_type>, 0>::make(
+                proto::eval(e, proto::default_context())));
+        }
+    };
+
+    // Wraps the expressions proto builds in memoize<>, with the given policies.  
+    // Operators applied to constants are folded as they are built, e.g. 
+    // in(x) * (constant(2) * 3) holds the constant 6, so the folded operators 
+    // are never marked, evaluated or cached.
+    template <typename Policies>
+    struct memoize_generator
+    {
+        BOOST_PROTO_CALLABLE()
+        BOOST_PROTO_USE_BASIC_EXPR()
+
+        template <typename Sig>
+        struct result;
+
+        template <typename This, typename Expr>
+        struct result<This(Expr)>
+            : generated < Expr, Policies >
+        {
+        };
+
+        template <typename This, typename Expr>
+        struct result<This(Expr&)>
+            : generated < Expr, Policies >
+        {
+        };
+
+        template <typename This, typename Expr>
+        struct result<This(Expr const&)>
+            : generated < Expr, Policies >
+        {
+        };
+
+        template <typename Expr>
+        typename generated<Expr, Policies>::type operator()(Expr const& e) const
+        {
+            return generated<Expr, Policies>::make(e);
+        }
+    };
+
+    template <typename Policies>
+    struct basic_memoize_domain;
+
+    typedef basic_memoize_domain<default_policies> memoize_domain;
+
+    // Every other domain is a sub-domain of memoize_domain, so that an 
+    // expression combining nodes with different policies is built in 
+    // memoize_domain, while each of those nodes keeps its own policies.
+    template <typename Policies>
+    struct memoize_super_domain
+    {
+        typedef memoize_domain type;
+    };
+
+    template <>
+    struct memoize_super_domain<default_policies>
+    {
+        typedef proto::no_super_domain type;
+    };
+
+    template <typename Policies>
+    struct basic_memoize_domain
+        : proto::domain < memoize_generator<Policies>, proto::_, typename memoize_super_domain<Policies>::type >
+    {
+        typedef Policies policies;
+
+        // The memoize domain customizes as_child so that expressions are held by 
+        // value.  This allows expression objects to be passed around or stored as
+        // class member data.
+        template <typename T>
+        struct as_child
+            : basic_memoize_domain::proto_base_domain::template as_expr < T >
+        {
+        };
+    };
+
+    // Per-node evaluation state that only some kinds of node need, recording 
+    // which of their children were read during their last evaluation.  
+    // 
+    // Conditional nodes (?:, && and ||) only evaluate one of their optional 
+    // children, and remember which one in "branch" so that only the condition 
+    // and the branch actually taken are treated as dependencies.  A value of 0 
+    // means no optional child was evaluated, otherwise it is the index of the 
+    // child that was.
+    // 
+    // Lazy function calls may read any subset of their arguments, and remember 
+    // which in "reads", where bit N is set if child N was read.  The callee 
+    // (child 0) never changes and so is never recorded.
+    // 
+    // The inputs a node read are then exactly those reachable through the 
+    // children it read, which is all that mark_dirty_context visits.
+    template <typename Expr, typename Tag = typename node_tag<Expr>::type>
+    struct node_state
+    {
+    };
+
+    struct conditional_node_state
+    {
+        conditional_node_state() : branch(0) {}
+
+        mutable int branch;
+    };
+
+    template <typename Expr>
+    struct node_state<Expr, proto::tag::if_else_> : conditional_node_state {};
+
+    template <typename Expr>
+    struct node_state<Expr, proto::tag::logical_and> : conditional_node_state {};
+
+    template <typename Expr>
+    struct node_state<Expr, proto::tag::logical_or> : conditional_node_state {};
+
+    template <typename Expr>
+    struct node_state<Expr, lazy_call>
+    {
+        node_state() : reads(0) {}
+
+        mutable unsigned long reads;
+    };
+
+    // The statistics gathered by a profile() node about its child.  A read that 
+    // finds the child clean is a hit; any other read recomputes the child, and 
+    // the time that takes is added to compute_time.
+    struct node_profile
+    {
+        typedef std::chrono::steady_clock clock;
+
+        node_profile() : reads(0), recomputations(0), compute_time(clock::duration::zero())
+        {
+        }
+
+        double hit_rate() const
+        {
+            return reads ? double(reads - recomputations) / reads : 0.0;
+        }
+
+        clock::duration average_cost() const
+        {
+            return recomputations ? compute_time / clock::rep(recomputations) : clock::duration::zero();
+        }
+
+        // Whether caching saved more time than it cost, where overhead is the 
+        // cost per read of caching the child's result: checking its dirty flag 
+        // and storing the result.  If not, the child is better recomputed (see 
+        // default_policies::recompute).
+        bool worth_caching(clock::duration overhead) const
+        {
+            return average_cost() * clock::rep(reads - recomputations) > overhead * clock::rep(reads);
+        }
+
+        unsigned long reads;
+        unsigned long recomputations;
+        clock::duration compute_time;
+    };
+
+    template <typename Expr>
+    struct node_state<Expr, profiled>
+    {
+        node_state() : stats(nullptr) {}
+
+        node_profile* stats;
+    };
+
+    // A stale-while-revalidate node re-evaluates its child on a worker pool 
+    // while it keeps serving its previous result.  "status" tells whether a job 
+    // is running or has finished and left its result in "fresh".  While a job is 
+    // running, the job owns the child's subtree.  Copying or destroying the 
+    // node blocks until the job finishes, and a copy gets its result.
+    template <typename Expr>
+    struct node_state<Expr, stale_while_revalidate>
+    {
+        enum { idle, running, done };
+
+        typedef typename std::decay<typename proto::result_of::eval<
+            typename std::remove_reference<typename proto::result_of::child_c<Expr, 0>::type>::type,
+            eval_cache_context const>::type>::type fresh_type;
+
+        node_state() : pool(&default_worker_pool()), status(idle), fresh() {}
+
+        // The node's subtree has already been copied, after waiting for the job, 
+        // so a finished job's result is up to date with it.
+        node_state(node_state const& other)
+            : pool(other.pool)
+            , status(other.status.load(std::memory_order_acquire) == done ? done : idle)
+            , fresh(other.fresh)
+        {
+        }
+
+        ~node_state()
+        {
+            wait();
+        }
+
+        // Blocks until no job is running.
+        void wait() const
+        {
+            std::unique_lock<std::mutex> lock(finish_mutex);
+            finished.wait(lock, [this]() { return status.load(std::memory_order_acquire) != running; });
+        }
+
+        // Called by the job as its last access to the node, which may be 
+        // destroyed as soon as the lock is released.
+        void finish(int result) const
+        {
+            std::lock_guard<std::mutex> lock(finish_mutex);
+            status.store(result, std::memory_order_release);
+            finished.notify_all();
+        }
+
+        worker_pool* pool;
+        mutable std::atomic<int> status;
+        mutable fresh_type fresh;
+        mutable std::mutex finish_mutex;
+        mutable std::condition_variable finished;
+    };
+
+    template <typename EvalContext, typename Expr>
+    void revalidate(Expr& e);
+
+    // Waits until no job owns the subtree of a node, so that it can be copied.
+    template <typename Expr, typename Tag>
+    void wait_until_idle(node_state<Expr, Tag> const&)
+    {
+    }
+
+    template <typename Expr>
+    void wait_until_idle(node_state<Expr, stale_while_revalidate> const& state)
+    {
+        state.wait();
+    }
+
+    // Whether the result of an expression depends on nothing but its type and 
+    // its operands' values: an operator, or a call of a callee without state, 
+    // such as a lambda that captures nothing.  A function pointer, 
+    // std::function or capturing lambda is part of the instance, not of the 
+    // type.
+    template <
+        typename Expr,
+        typename Tag = typename proto::tag_of<Expr>::type>
+    struct has_stateless_callee : std::true_type
+    {
+    };
+
+    template <typename Expr>
+    struct has_stateless_callee < Expr, proto::tag::function >
+        : std::is_empty < decltype(callee_of<Expr>::type::f) >
+    {
+    };
+
+    template <
+        typename Expr,
+        typename Tag = typename proto::tag_of<Expr>::type>
+    struct has_pointer_callee : std::false_type
+    {
+    };
+
+    template <typename Expr>
+    struct has_pointer_callee < Expr, proto::tag::function >
+        : std::is_pointer < decltype(callee_of<Expr>::type::f) >
+    {
+    };
+
+    // The values of the operands of an expression, which together with the 
+    // expression's callee, if any, determine its result.  The callee of a 
+    // function call is left out, because a cached<K>() node keys only its own 
+    // child, whose callee doesn't change; shared() adds it (see shared_key).
+    template <
+        typename Expr,
+        std::size_t First = std::is_same<typename proto::tag_of<Expr>::type, proto::tag::function>::value ? 1 : 0,
+        typename Indices = std::make_index_sequence<proto::arity_of<Expr>::value - First> >
+    struct operand_values;
+
+    template <typename Expr, std::size_t First, std::size_t... I>
+    struct operand_values < Expr, First, std::index_sequence<I...> >
+    {
+        static_assert(
+            std::is_same<typename node_tag<Expr>::type, typename proto::tag_of<Expr>::type>::value &&
+            !std::is_same<typename proto::tag_of<Expr>::type, proto::tag::terminal>::value &&
+            !std::is_same<typename proto::tag_of<Expr>::type, proto::tag::if_else_>::value &&
+            !std::is_same<typename proto::tag_of<Expr>::type, proto::tag::logical_and>::value &&
+            !std::is_same<typename proto::tag_of<Expr>::type, proto::tag::logical_or>::value,
+            "only expressions that evaluate all of their operands can be keyed by their operands");
+
+        typedef std::tuple<typename std::decay<typename proto::result_of::eval<
+            typename std::remove_reference<typename proto::result_of::child_c<Expr, I + First>::type>::type,
+            eval_cache_context const>::type>::type...> type;
+
+        template <typename Context>
+        static type get(Expr const& e, Context const& ctx)
+        {
+            return type(proto::eval(proto::child_c<I + First>(e), ctx)...);
+        }
+    };
+
+    // A function pointer as part of a key, ordered by address.
+    template <typename F>
+    struct callee_address
+    {
+        F f;
+
+        friend bool operator==(callee_address const& a, callee_address const& b)
+        {
+            return a.f == b.f;
+        }
+
+        friend bool operator<(callee_address const& a, callee_address const& b)
+        {
+            return std::less<F>()(a.f, b.f);
+        }
+    };
+
+    // The key of the results of an expression in its shared_table: the values 
+    // of its operands, preceded by its callee if that is a function pointer, 
+    // which two instances of the same type can hold different values of.  
+    // Other callees with state can't be compared, and shared() rejects them.
+    template <typename Expr, bool = has_pointer_callee<Expr>::value>
+    struct shared_key : operand_values<Expr>
+    {
+    };
+
+    template <typename Expr>
+    struct shared_key < Expr, true >
+    {
+        typedef callee_address<decltype(callee_of<Expr>::type::f)> callee_type;
+        typedef std::pair<callee_type, typename operand_values<Expr>::type> type;
+
+        template <typename Context>
+        static type get(Expr const& e, Context const& ctx)
+        {
+            return type(callee_type{ proto::value(proto::child_c<0>(e)).f }, operand_values<Expr>::get(e, ctx));
+        }
+    };
+
+    // A table of the K most recently used results of some computation, keyed by 
+    // its operands.  K is expected to be small, so lookup is a linear search.
+    template <typename Key, typename Value, std::size_t K>
+    class lru_table
+    {
+        static_assert(K > 0, "an lru_table must have at least one entry");
+
+    public:
+        lru_table() : _size(0), _clock(0)
+        {
+        }
+
+        // Returns the value for key, or null if it isn't in the table.
+        Value const* find(Key const& key)
+        {
+            for (std::size_t i = 0; i < _size; ++i)
+            {
+                if (_entries[i].key == key)
+                {
+                    _entries[i].last_used = ++_clock;
+                    return &_entries[i].value;
+                }
+            }
+            return nullptr;
+        }
+
+        // Adds an entry, replacing the least recently used one if the table is 
+        // full.
+        void insert(Key key, Value const& value)
+        {
+            std::size_t i = _size;
+            if (_size < K)
+            {
+                ++_size;
+            }
+            else
+            {
+                i = 0;
+                for (std::size_t j = 1; j < K; ++j)
+                    if (_entries[j].last_used < _entries[i].last_used) i = j;
+            }
+            _entries[i].key = std::move(key);
+            _entries[i].value = value;
+            _entries[i].last_used = ++_clock;
+        }
+
+    private:
+        struct entry
+        {
+            Key key;
+            Value value;
+            std::size_t last_used;
+        };
+
+        entry _entries[K];
+        std::size_t _size;
+        std::size_t _clock;
+    };
+
+    // The results of an expression type, keyed by the values of its operands and 
+    // shared by all instances of the type.  Entries are held weakly, so a result 
+    // lives only as long as some node refers to it.  It is safe to use from 
+    // multiple threads.
+    template <typename Expr>
+    class shared_table
+    {
+    public:
+        typedef typename shared_key<Expr>::type key_type;
+        typedef typename Expr::cache_type value_type;
+
+        static shared_table& instance()
+        {
+            static shared_table table;
+            return table;
+        }
+
+        // Returns the result for key, or null if no node currently holds one.
+        std::shared_ptr<value_type const> find(key_type const& key)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto i = _entries.find(key);
+            return i == _entries.end() ? nullptr : i->second.lock();
+        }
+
+        // Adds a result computed outside the lock.  If another thread added one 
+        // for the same key in the meantime, that one is returned instead.
+        std::shared_ptr<value_type const> insert(key_type key, value_type value)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto& entry = _entries[std::move(key)];
+            auto existing = entry.lock();
+            if (existing) return existing;
+
+            auto result = std::make_shared<value_type const>(std::move(value));
+            entry = result;
+            if (_entries.size() >= 2 * _live) sweep();
+            return result;
+        }
+
+    private:
+        shared_table() : _live(1)
+        {
+        }
+
+        // Drops the entries whose results are no longer referenced.
+        void sweep()
+        {
+            for (auto i = _entries.begin(); i != _entries.end();)
+            {
+                if (i->second.expired()) i = _entries.erase(i);
+                else ++i;
+            }
+            _live = _entries.size() ? _entries.size() : 1;
+        }
+
+        std::mutex _mutex;
+        std::map<key_type, std::weak_ptr<value_type const> > _entries;
+        std::size_t _live;
+    };
+
+    // The reductions that aggregate nodes apply.  Each maps elements to leaf 
+    // values, and combines leaf values with an associative, commutative 
+    // operation whose identity is identity().
+    struct sum_op
+    {
+        template <typename T>
+        T leaf(T const& x) const { return x; }
+
+        template <typename R>
+        R combine(R const& a, R const& b) const { return a + b; }
+
+        template <typename R>
+        R identity() const { return R(); }
+    };
+
+    template <typename Predicate>
+    struct count_if_op
+    {
+        Predicate predicate;
+
+        template <typename T>
+        std::size_t leaf(T const& x) const { return predicate(x) ? 1 : 0; }
+
+        std::size_t combine(std::size_t a, std::size_t b) const { return a + b; }
+
+        template <typename R>
+        R identity() const { return 0; }
+    };
+
+    struct min_op
+    {
+        template <typename T>
+        T leaf(T const& x) const { return x; }
+
+        template <typename R>
+        R combine(R const& a, R const& b) const { return b < a ? b : a; }
+
+        template <typename R>
+        R identity() const { return std::numeric_limits<R>::max(); }
+    };
+
+    struct max_op
+    {
+        template <typename T>
+        T leaf(T const& x) const { return x; }
+
+        template <typename R>
+        R combine(R const& a, R const& b) const { return a < b ? b : a; }
+
+        template <typename R>
+        R identity() const { return std::numeric_limits<R>::lowest(); }
+    };
+
+    // The value of a node built by sum_of(), min_of() or max_of(), which 
+    // combines the results of its children E... with Op.  The children are held 
+    // in a flat tuple rather than as a tree of binary operators, so the node's 
+    // type doesn't nest with each child, its number of children isn't limited 
+    // by BOOST_PROTO_MAX_ARITY, and the group has a single dirty flag and 
+    // result.  The cache holds the result, as it does for an input.
+    template <typename Op, typename... E>
+    struct nary
+    {
+        typedef typename std::common_type<typename std::decay<
+            typename proto::result_of::eval<E, eval_cache_context const>::type>::type...>::type value_type;
+
+        nary(Op const& op, E const&... e) : op(op), children(e...), cache()
+        {
+        }
+
+        Op op;
+        std::tuple<E...> children;
+        mutable value_type cache;
+    };
+
+    template <typename Op, typename... E>
+    std::ostream& operator<<(std::ostream& s, const nary<Op, E...>&)
+    {
+        s << "nary(" << sizeof...(E) << ")";
+        return s;
+    }
+
+    template <typename Op, typename... E>
+    struct is_constant<nary<Op, E...> > : std::false_type {};
+
+    // Whether an aggregate node's input can report what changed; see 
+    // tracked_vector.  Other containers are reduced from scratch.
+    template <typename C, typename F>
+    bool changes_since(C const&, unsigned, F)
+    {
+        return false;
+    }
+
+    template <typename C>
+    unsigned version_of(C const&)
+    {
+        return 0;
+    }
+
+    template <typename T, typename F>
+    bool changes_since(tracked_vector<T> const& items, unsigned version, F f)
+    {
+        return items.changes_since(version, f);
+    }
+
+    template <typename T>
+    unsigned version_of(tracked_vector<T> const& items)
+    {
+        return items.version();
+    }
+
+    template <typename T, typename F>
+    bool changes_since(hashed_array<T> const& items, unsigned version, F f)
+    {
+        return items.changes_since(version, f);
+    }
+
+    template <typename T>
+    unsigned version_of(hashed_array<T> const& items)
+    {
+        return items.version();
+    }
+
+    // The reduction of a container, kept as a segment tree of the leaf values 
+    // so that changing k elements updates the total in O(k log n) time.  The 
+    // tree's capacity is a power of two, with identity() in the unused leaves.
+    template <typename Op, typename R>
+    class aggregate_tree
+    {
+    public:
+        aggregate_tree() : _capacity(0), _source(nullptr), _version(0)
+        {
+        }
+
+        // Brings the tree up to date with items, using their log of changes if 
+        // these are the items it last saw, and returns the total.
+        template <typename C>
+        R const& update(C const& items, Op const& op)
+        {
+            bool incremental = &items == _source && items.size() <= _capacity;
+            if (incremental)
+            {
+                // A change that inserts or removes elements moves every element 
+                // after it.
+                incremental = changes_since(items, _version,
+                    [&](std::size_t first, std::size_t removed, std::size_t inserted)
+                {
+                    const std::size_t last = removed == inserted ? first + removed : _capacity;
+                    if (first < _capacity) update(items, op, first, std::min(last, _capacity));
+                });
+            }
+            if (!incremental) rebuild(items, op);
+            _source = &items;
+            _version = version_of(items);
+            return _nodes[1];
+        }
+
+    private:
+        template <typename C>
+        R leaf(C const& items, Op const& op, std::size_t i) const
+        {
+            return i < items.size() ? op.leaf(items[i]) : op.template identity<R>();
+        }
+
+        template <typename C>
+        void rebuild(C const& items, Op const& op)
+        {
+            _capacity = 1;
+            while (_capacity < items.size()) _capacity *= 2;
+            _nodes.assign(2 * _capacity, op.template identity<R>());
+            update(items, op, 0, _capacity);
+        }
+
+        // Sets leaves [first, last), then the nodes above them, level by level.
+        template <typename C>
+        void update(C const& items, Op const& op, std::size_t first, std::size_t last)
+        {
+            if (first >= last) return;
+            for (std::size_t i = first; i < last; ++i)
+                _nodes[_capacity + i] = leaf(items, op, i);
+            for (std::size_t lo = (_capacity + first) / 2, hi = (_capacity + last - 1) / 2; lo > 0; lo /= 2, hi /= 2)
+            {
+                for (std::size_t i = lo; i <= hi; ++i)
+                    _nodes[i] = op.combine(_nodes[2 * i], _nodes[2 * i + 1]);
+            }
+        }
+
+        std::vector<R> _nodes;
+        std::size_t _capacity;
+        void const* _source;
+        unsigned _version;
+    };
+
+    // The sum of the last samples of a ring_buffer.  Each new sample is added, 
+    // and the one it pushes out of the window subtracted.  The state keeps its 
+    // own copy of the samples in the window, so the ones to subtract are still 
+    // at hand after the ring_buffer has overwritten them, even when the window 
+    // is as large as the buffer.  Floating-point samples are summed with 
+    // Neumaier's compensated summation, and re-summed from the window each 
+    // time as many samples as it holds have left it, so that the rounding 
+    // error of a sample that has left doesn't stay in the total.
+    template <typename T>
+    class moving_sum_state
+    {
+        typedef std::is_floating_point<T> inexact;
+
+    public:
+        moving_sum_state() : _total(), _error(), _value(), _seen(0), _left(0)
+        {
+        }
+
+        T const& update(ring_buffer<T> const& samples, std::size_t window)
+        {
+            const unsigned long long count = samples.count();
+            const std::size_t held = std::min(window, samples.capacity());
+            if (_seen > count)
+            {
+                _window.clear();
+                _seen = 0;
+                resum();
+            }
+            // Samples overwritten before this update were already outside the 
+            // window, so only the last ones still held need adding.
+            for (unsigned long long n = std::max(_seen, count - std::min<unsigned long long>(held, samples.size())); n < count; ++n)
+            {
+                _window.push_back(samples.sample(n));
+                add(_window.back(), inexact());
+            }
+            for (; _window.size() > held; _window.pop_front(), ++_left)
+                subtract(_window.front(), inexact());
+            if (inexact::value && _left >= held)
+                resum();
+            _seen = count;
+            return result(inexact());
+        }
+
+    private:
+        void add(T const& x, std::true_type)
+        {
+            const T total = _total + x;
+            _error += std::abs(_total) >= std::abs(x) ? (_total - total) + x : (x - total) + _total;
+            _total = total;
+        }
+
+        void add(T const& x, std::false_type)
+        {
+            _total += x;
+        }
+
+        void subtract(T const& x, std::true_type)
+        {
+            add(-x, std::true_type());
+        }
+
+        void subtract(T const& x, std::false_type)
+        {
+            _total -= x;
+        }
+
+        void resum()
+        {
+            _total = T();
+            _error = T();
+            _left = 0;
+            for (T const& x : _window)
+                add(x, inexact());
+        }
+
+        T const& result(std::true_type)
+        {
+            _value = _total + _error;
+            return _value;
+        }
+
+        T const& result(std::false_type)
+        {
+            return _total;
+        }
+
+        std::deque<T> _window;
+        T _total;
+        T _error;
+        T _value;
+        unsigned long long _seen;
+        std::size_t _left;
+    };
+
+    // The least (or greatest) of the last samples of a ring_buffer, kept as a 
+    // queue of the samples that could still become the extreme as older ones 
+    // leave the window.  Each sample enters and leaves the queue once, so an 
+    // update costs amortized O(1) per new sample.
+    template <typename T, typename Compare>
+    class moving_extreme_state
+    {
+    public:
+        moving_extreme_state() : _seen(0), _value()
+        {
+        }
+
+        T const& update(ring_buffer<T> const& samples, std::size_t window)
+        {
+            const unsigned long long count = samples.count();
+            const unsigned long long oldest = count - std::min<unsigned long long>(window, samples.size());
+            if (_seen > count) _candidates.clear();
+            for (unsigned long long n = std::max(_seen, oldest); n < count; ++n)
+            {
+                T const& x = samples.sample(n);
+                while (!_candidates.empty() && !Compare()(_candidates.back().second, x))
+                    _candidates.pop_back();
+                _candidates.emplace_back(n, x);
+            }
+            while (!_candidates.empty() && _candidates.front().first < oldest)
+                _candidates.pop_front();
+            _seen = count;
+            _value = _candidates.empty() ? T() : _candidates.front().second;
+            return _value;
+        }
+
+    private:
+        std::deque<std::pair<unsigned long long, T> > _candidates;
+        unsigned long long _seen;
+        T _value;
+    };
+
+    // The average of the last samples of a ring_buffer, from their sum.
+    template <typename T>
+    class moving_mean_state
+    {
+    public:
+        typedef typename std::common_type<T, double>::type value_type;
+
+        moving_mean_state() : _value()
+        {
+        }
+
+        value_type const& update(ring_buffer<T> const& samples, std::size_t window)
+        {
+            T const& total = _sum.update(samples, window);
+            const std::size_t n = std::min(window, samples.size());
+            _value = n ? total / static_cast<value_type>(n) : value_type();
+            return _value;
+        }
+
+    private:
+        moving_sum_state<T> _sum;
+        value_type _value;
+    };
+
+    // The kind of a windowed node that averages its window.
+    struct mean_op {};
+
+    template <typename Kind, typename T>
+    struct window_state;
+
+    template <typename T>
+    struct window_state < mean_op, T >
+    {
+        typedef moving_mean_state<T> type;
+    };
+
+    template <typename T>
+    struct window_state < sum_op, T >
+    {
+        typedef moving_sum_state<T> type;
+    };
+
+    template <typename T>
+    struct window_state < min_op, T >
+    {
+        typedef moving_extreme_state<T, std::less<T> > type;
+    };
+
+    template <typename T>
+    struct window_state < max_op, T >
+    {
+        typedef moving_extreme_state<T, std::greater<T> > type;
+    };
+
+    // A windowed node keeps the size of its window and the state of its 
+    // reduction.
+    template <typename Expr, typename Kind>
+    struct node_state < Expr, windowed<Kind> >
+    {
+        typedef typename std::decay<typename proto::result_of::eval<
+            typename std::remove_reference<typename proto::result_of::child_c<Expr, 0>::type>::type,
+            eval_cache_context const>::type>::type::value_type sample_type;
+
+        typedef typename window_state<Kind, sample_type>::type state_type;
+        typedef typename std::decay<decltype(std::declval<state_type&>().update(
+            std::declval<ring_buffer<sample_type> const&>(), 0))>::type value_type;
+
+        std::size_t window;
+        mutable state_type state;
+    };
+
+    // A value computed from each element of a container.  When the container is 
+    // a tracked_vector seen before, its changes are replayed on the values, 
+    // moving the values of elements that were moved and recomputing only the 
+    // values of elements that were changed or inserted.
+    template <typename R>
+    class element_cache
+    {
+    public:
+        element_cache() : _source(nullptr), _version(0)
+        {
+        }
+
+        // Brings the values up to date with items, and returns the index of the 
+        // first value that may have changed, or items.size() if none did.
+        template <typename C, typename F>
+        std::size_t update(C const& items, F const& f)
+        {
+            std::size_t lo = items.size(), hi = 0;
+            bool changed = false;
+            bool incremental = &items == _source;
+            if (incremental)
+            {
+                incremental = changes_since(items, _version,
+                    [&](std::size_t first, std::size_t removed, std::size_t inserted)
+                {
+                    splice(first, removed, inserted);
+
+                    // Keep [lo, hi) around the values left to compute, and the 
+                    // positions where values were removed.
+                    auto moved = [&](std::size_t i)
+                    {
+                        return i < first ? i : i >= first + removed ? i + inserted - removed : first;
+                    };
+                    lo = changed ? std::min(moved(lo), first) : first;
+                    hi = changed ? std::max(moved(hi), first + inserted) : first + inserted;
+                    changed = true;
+                });
+            }
+            if (!incremental)
+            {
+                _values.assign(items.size(), R());
+                _fresh.assign(items.size(), false);
+                lo = 0;
+                hi = items.size();
+            }
+
+            for (std::size_t i = lo; i < hi; ++i)
+            {
+                if (!_fresh[i])
+                {
+                    _values[i] = f(items[i]);
+                    _fresh[i] = true;
+                }
+            }
+            _source = &items;
+            _version = version_of(items);
+            return std::min(lo, items.size());
+        }
+
+        std::vector<R> const& values() const { return _values; }
+
+    private:
+        void splice(std::size_t first, std::size_t removed, std::size_t inserted)
+        {
+            const std::size_t common = std::min(removed, inserted);
+            std::fill(_fresh.begin() + first, _fresh.begin() + first + common, false);
+            if (removed > common)
+            {
+                _values.erase(_values.begin() + first + common, _values.begin() + first + removed);
+                _fresh.erase(_fresh.begin() + first + common, _fresh.begin() + first + removed);
+            }
+            else if (inserted > common)
+            {
+                _values.insert(_values.begin() + first + common, inserted - common, R());
+                _fresh.insert(_fresh.begin() + first + common, inserted - common, false);
+            }
+        }
+
+        std::vector<R> _values;
+        std::vector<bool> _fresh;
+        void const* _source;
+        unsigned _version;
+    };
+
+    // transform() and filter() nodes keep the values computed from each 
+    // element of their container, which is their first child, with the 
+    // function that is their second child.
+    template <typename Expr>
+    struct element_node_state
+    {
+        typedef typename std::decay<typename proto::result_of::eval<
+            typename std::remove_reference<typename proto::result_of::child_c<Expr, 0>::type>::type,
+            eval_cache_context const>::type>::type container_type;
+        typedef typename std::decay<typename proto::result_of::eval<
+            typename std::remove_reference<typename proto::result_of::child_c<Expr, 1>::type>::type,
+            eval_cache_context const>::type>::type function_type;
+        typedef typename std::decay<decltype(std::declval<function_type const&>()(
+            std::declval<typename container_type::value_type const&>()))>::type value_type;
+    };
+
+    template <typename Expr>
+    struct node_state < Expr, mapped > : element_node_state < Expr >
+    {
+        mutable element_cache<typename element_node_state<Expr>::value_type> values;
+    };
+
+    template <typename Expr>
+    struct node_state < Expr, filtered > : element_node_state < Expr >
+    {
+        mutable element_cache<bool> keep;
+    };
+
+    // An aggregate node keeps the tree of its container's elements.  The 
+    // operation is its second child, as a function<Op>.
+    template <typename Expr, typename Op>
+    struct node_state < Expr, aggregate<Op> >
+    {
+        typedef typename std::decay<typename proto::result_of::eval<
+            typename std::remove_reference<typename proto::result_of::child_c<Expr, 0>::type>::type,
+            eval_cache_context const>::type>::type container_type;
+        typedef typename std::decay<decltype(std::declval<Op const&>().leaf(
+            std::declval<typename container_type::value_type const&>()))>::type value_type;
+
+        mutable aggregate_tree<Op, value_type> tree;
+    };
+
+    // A node built by shared() refers to its result in the shared_table, rather 
+    // than keeping a copy of its own.
+    template <typename Expr>
+    struct node_state < Expr, shared_result >
+    {
+        typedef typename std::decay<typename proto::result_of::child_c<Expr, 0>::type>::type child_type;
+        typedef shared_key<child_type> key_type;
+
+        mutable std::shared_ptr<typename child_type::cache_type const> value;
+    };
+
+    // A node built by cached<K>() keeps the table of its child's results.
+    template <typename Expr, std::size_t K>
+    struct node_state < Expr, lru<K> >
+    {
+        typedef typename std::decay<typename proto::result_of::child_c<Expr, 0>::type>::type child_type;
+        typedef operand_values<child_type> key_type;
+
+        mutable lru_table<typename key_type::type, typename child_type::cache_type, K> table;
+    };
+
+    // Whether values of type T are treated as containers by elementwise(), 
+    // rather than as scalars.  Specialize for other containers with size() and 
+    // operator[].
+    template <typename T>
+    struct is_element_container : std::false_type {};
+
+    template <typename T, typename A>
+    struct is_element_container<std::vector<T, A> > : std::true_type {};
+
+    template <typename T>
+    struct is_element_container<tracked_vector<T> > : std::true_type {};
+
+    template <typename T>
+    struct is_element_container<hashed_array<T> > : std::true_type {};
+
+    template <typename T>
+    struct is_element_container<ring_buffer<T> > : std::true_type {};
+
+    // The operators that elementwise() applies to each element.
+    template <typename Tag>
+    struct is_elementwise : std::false_type {};
+
+    // Whether the operator of tag Tag also applies to operands of the types in 
+    // the tuple Operands as whole values, e.g. == on two vectors.
+    template <typename Tag, typename Operands, typename Enable = void>
+    struct applies_whole : std::false_type {};
+
+#define MEMOIZE_ELEMENTWISE_UNARY(Tag, op) \
+    template <> \
+    struct is_elementwise<proto::tag::Tag> : std::true_type {}; \
+    template <typename A> \
+    struct applies_whole<proto::tag::Tag, std::tuple<A>, \
+        decltype(void(op std::declval<A const&>()))> : std::true_type {};
+
+#define MEMOIZE_ELEMENTWISE_BINARY(Tag, op) \
+    template <> \
+    struct is_elementwise<proto::tag::Tag> : std::true_type {}; \
+    template <typename A, typename B> \
+    struct applies_whole<proto::tag::Tag, std::tuple<A, B>, \
+        decltype(void(std::declval<A const&>() op std::declval<B const&>()))> : std::true_type {};
+
+    MEMOIZE_ELEMENTWISE_UNARY(unary_plus, +)
+    MEMOIZE_ELEMENTWISE_UNARY(negate, -)
+    MEMOIZE_ELEMENTWISE_UNARY(complement, ~)
+    MEMOIZE_ELEMENTWISE_UNARY(logical_not, !)
+    MEMOIZE_ELEMENTWISE_BINARY(multiplies, *)
+    MEMOIZE_ELEMENTWISE_BINARY(divides, /)
+    MEMOIZE_ELEMENTWISE_BINARY(modulus, %)
+    MEMOIZE_ELEMENTWISE_BINARY(plus, +)
+    MEMOIZE_ELEMENTWISE_BINARY(minus, -)
+    MEMOIZE_ELEMENTWISE_BINARY(shift_left, <<)
+    MEMOIZE_ELEMENTWISE_BINARY(shift_right, >>)
+    MEMOIZE_ELEMENTWISE_BINARY(less, <)
+    MEMOIZE_ELEMENTWISE_BINARY(greater, >)
+    MEMOIZE_ELEMENTWISE_BINARY(less_equal, <=)
+    MEMOIZE_ELEMENTWISE_BINARY(greater_equal, >=)
+    MEMOIZE_ELEMENTWISE_BINARY(equal_to, ==)
+    MEMOIZE_ELEMENTWISE_BINARY(not_equal_to, !=)
+    MEMOIZE_ELEMENTWISE_BINARY(bitwise_and, &)
+    MEMOIZE_ELEMENTWISE_BINARY(bitwise_or, |)
+    MEMOIZE_ELEMENTWISE_BINARY(bitwise_xor, ^)
+
+#undef MEMOIZE_ELEMENTWISE_UNARY
+#undef MEMOIZE_ELEMENTWISE_BINARY
+
+    template <typename Expr, typename Tag = typename proto::tag_of<Expr>::type>
+    struct is_constant_terminal : std::false_type {};
+
+    template <typename Expr>
+    struct is_constant_terminal < Expr, proto::tag::terminal >
+        : is_constant < typename std::decay<typename proto::result_of::value<Expr>::type>::type >
+    {
+    };
+
+    template <
+        typename Expr,
+        typename Indices = std::make_index_sequence<proto::arity_of<Expr>::value> >
+    struct has_only_constant_children;
+
+    template <typename Expr, std::size_t... I>
+    struct has_only_constant_children < Expr, std::index_sequence<I...> >
+        : std::is_same <
+            std::integer_sequence<bool, true, is_constant_terminal<typename std::decay<
+                typename proto::result_of::child_c<Expr, I>::type>::type>::value...>,
+            std::integer_sequence<bool, is_constant_terminal<typename std::decay<
+                typename proto::result_of::child_c<Expr, I>::type>::type>::value..., true> >
+    {
+    };
+
+    template <typename Expr>
+    struct is_foldable
+        : std::integral_constant < bool,
+            is_elementwise<typename proto::tag_of<Expr>::type>::value &&
+            has_only_constant_children<Expr>::value >
+    {
+    };
+
+    // Whether an operator is cheaper to recompute than to cache when its 
+    // result is arithmetic, e.g. int addition.  True for the built-in operators; 
+    // specialize it for other tags.
+    template <typename Tag>
+    struct is_cheap : is_elementwise<Tag> {};
+
+    // The nodes that can be recomputed rather than cached: operators and eager 
+    // function calls, which only apply their operator to their children's 
+    // results.
+    template <typename Tag>
+    struct can_recompute : is_elementwise<Tag> {};
+
+    template <>
+    struct can_recompute<proto::tag::function> : std::true_type {};
+
+    // Whether a node with the given policies, tag and result type is recomputed 
+    // rather than cached (see default_policies::recompute).
+    template <typename Policies, typename Tag, typename T>
+    struct is_recomputed
+        : std::integral_constant < bool, can_recompute<Tag>::value &&
+            Policies::template recompute<Tag, T>::value >
+    {
+    };
+
+    // Recomputes the built-in operators when their result is arithmetic.  Use 
+    // with_policies<recompute_cheap>() on the inputs of an expression of cheap 
+    // arithmetic, so that every operator built from them is recomputed.
+    struct recompute_cheap : default_policies
+    {
+        template <typename Tag, typename T>
+        struct recompute : std::integral_constant < bool,
+            is_cheap<Tag>::value && std::is_arithmetic<T>::value >
+        {
+        };
+    };
+
+    // Recomputes a single node, e.g. with_policies<recompute_always>(f(x)) for 
+    // a function f that costs less than caching its result.
+    struct recompute_always : default_policies
+    {
+        template <typename Tag, typename T>
+        struct recompute : std::true_type
+        {
+        };
+    };
+
+    // Whether evaluating an expression element by element reads a container, 
+    // either directly or through element-wise operators.  Element-wise 
+    // operators with container operands are only evaluated by elementwise(), 
+    // element by element, so they have no result of their own.
+    template <
+        typename Expr,
+        typename Tag = typename node_tag<Expr>::type,
+        bool Elementwise = is_elementwise<Tag>::value>
+    struct has_container_operand
+        : is_element_container<typename std::decay<
+            typename proto::result_of::eval<Expr, eval_cache_context const>::type>::type>
+    {
+    };
+
+    template <
+        typename Expr,
+        typename Indices = std::make_index_sequence<proto::arity_of<Expr>::value> >
+    struct has_container_child;
+
+    template <typename Expr, std::size_t... I>
+    struct has_container_child < Expr, std::index_sequence<I...> >
+        : std::integral_constant < bool, !std::is_same <
+            std::integer_sequence<bool, false, has_container_operand<typename std::decay<
+                typename proto::result_of::child_c<Expr, I>::type>::type>::value...>,
+            std::integer_sequence<bool, has_container_operand<typename std::decay<
+                typename proto::result_of::child_c<Expr, I>::type>::type>::value..., false>
+        >::value >
+    {
+    };
+
+    template <typename Expr, typename Tag>
+    struct has_container_operand < Expr, Tag, true >
+        : has_container_child < Expr >
+    {
+    };
+
+    // Whether an expression can be evaluated as a whole, rather than only 
+    // element by element by elementwise().  An element-wise operator can if its 
+    // operands can and it applies to their values, e.g. == on two vectors; 
+    // such a node keeps a result like any other, which elementwise() doesn't 
+    // use.
+    template <
+        typename Expr,
+        typename Tag = typename node_tag<Expr>::type,
+        bool Elementwise = is_elementwise<Tag>::value>
+    struct evaluates_whole : std::true_type
+    {
+    };
+
+    template <
+        typename Expr,
+        typename Indices = std::make_index_sequence<proto::arity_of<Expr>::value> >
+    struct applies_to_operands;
+
+    template <typename Expr, std::size_t... I>
+    struct applies_to_operands < Expr, std::index_sequence<I...> >
+        : applies_whole < typename node_tag<Expr>::type, std::tuple<typename std::decay<
+            typename proto::result_of::eval<typename std::remove_reference<
+                typename proto::result_of::child_c<Expr, I>::type>::type, eval_cache_context const>::type>::type...> >
+    {
+    };
+
+    template <
+        typename Expr,
+        typename Indices = std::make_index_sequence<proto::arity_of<Expr>::value> >
+    struct children_evaluate_whole;
+
+    template <typename Expr, std::size_t... I>
+    struct children_evaluate_whole < Expr, std::index_sequence<I...> >
+        : std::is_same <
+            std::integer_sequence<bool, true, evaluates_whole<typename std::decay<
+                typename proto::result_of::child_c<Expr, I>::type>::type>::value...>,
+            std::integer_sequence<bool, evaluates_whole<typename std::decay<
+                typename proto::result_of::child_c<Expr, I>::type>::type>::value..., true> >
+    {
+    };
+
+    template <typename Expr, typename Tag>
+    struct evaluates_whole < Expr, Tag, true >
+        : std::conditional <
+            children_evaluate_whole<Expr>::value,
+            applies_to_operands<Expr>,
+            std::false_type >::type
+    {
+    };
+
+    // Terminals keep their cached value in the terminal's value (see input), so 
+    // they have no use for memoize<>::result.
+    struct terminal_result {};
+
+    // Whether a node keeps its result somewhere other than memoize<>::result.
+    template <typename Tag>
+    struct keeps_own_result : std::false_type {};
+
+    template <>
+    struct keeps_own_result<proto::tag::terminal> : std::true_type {};
+
+    template <>
+    struct keeps_own_result<shared_result> : std::true_type {};
+
+    template <>
+    struct keeps_own_result<mapped> : std::true_type {};
+
+    template <>
+    struct keeps_own_result<profiled> : std::true_type {};
+
+    template <std::size_t K>
+    struct keeps_own_result<lru<K> > : std::true_type {};
+
+    template <typename Expr, typename Policies>
+    struct memoize
+        : proto::extends < Expr, memoize<Expr, Policies>, basic_memoize_domain<Policies> >
+        , node_state < Expr >
+    {
+        typedef proto::extends<Expr, memoize<Expr, Policies>, basic_memoize_domain<Policies> > base_type;
+        typedef Policies policies;
+        typedef typename std::decay<typename mpl::eval_if <
+            mpl::or_ <
+                keeps_own_result<typename node_tag<Expr>::type>,
+                mpl::and_ <
+                    is_elementwise<typename node_tag<Expr>::type>,
+                    has_container_operand<Expr>,
+                    mpl::not_<evaluates_whole<Expr> > > >,
+            mpl::identity<terminal_result>,
+            proto::result_of::eval<memoize<Expr, Policies>, eval_cache_context const>
+        > ::type>::type computed_type;
+        typedef typename mpl::if_ <
+            is_recomputed<Policies, typename node_tag<Expr>::type, computed_type>,
+            terminal_result,
+            computed_type
+        > ::type cache_type;
+        typedef typename Policies::template result_storage<cache_type>::type storage_type;
+
+        memoize(Expr const& expr = Expr()) : base_type(expr), dirty(true) {}
+
+        // A result that can't be copied, such as a unique_ptr, is left out of 
+        // the copy, which recomputes it instead.
+        memoize(memoize const& other)
+            : base_type(settled(other))
+            , node_state<Expr>(other)
+            , result(copy_result(other.result, std::is_copy_constructible<storage_type>()))
+            , dirty(other.dirty || !std::is_copy_constructible<storage_type>::value)
+        {
+        }
+
+        // Function call expressions created by proto::extends hold the callee by 
+        // reference.  Hold it by value, like every other child.
+        template <typename... A>
+        typename proto::result_of::make_expr<
+            proto::tag::function, basic_memoize_domain<Policies>, memoize const&, A const&...>::type
+            operator()(A const&... a) const
+        {
+            return proto::make_expr<proto::tag::function, basic_memoize_domain<Policies> >(*this, a...);
+        }
+
+        mutable storage_type result;
+
+    private:
+        static memoize const& settled(memoize const& other)
+        {
+            wait_until_idle(static_cast<node_state<Expr> const&>(other));
+            return other;
+        }
+
+        static storage_type const& copy_result(storage_type const& result, std::true_type) { return result; }
+        static storage_type copy_result(storage_type const&, std::false_type) { return storage_type(); }
+
+    public:
+        // Fix me: This flag is only meaningful for non-terminals. Terminal 
+        // dirtiness is determined by Policies::same() on the source data.
+        mutable typename Policies::flag_type dirty;
+    };
+
+    template <typename T>
+    struct is_terminal : mpl::false_ {};
+
+    template <typename T>
+    struct is_terminal<input<T> > : mpl::true_{};
+
+    BOOST_PROTO_DEFINE_OPERATORS(is_terminal, memoize_domain);
+
+    // Builds a memoized conditional expression, the equivalent of 
+    // "c ? t : f".  Only the branch selected by the condition is evaluated, 
+    // and changes to the other branch don't cause re-evaluation.
+    template <typename C, typename T, typename F>
+    typename proto::result_of::make_expr<
+        proto::tag::if_else_, memoize_domain, C const&, T const&, F const&>::type
+        if_then_else(C const& c, T const& t, F const& f)
+    {
+        return proto::make_expr<proto::tag::if_else_, memoize_domain>(c, t, f);
+    }
+
+    // Builds a node that remembers the results of an expression for the K most 
+    // recently used combinations of its operands' values, so that when the 
+    // operands return to recently seen values (e.g. hover on and off) the 
+    // expression's operator isn't applied again.  The expression must be an 
+    // operator or eager function call, and its operands must be 
+    // EqualityComparable.
+    template <std::size_t K, typename E>
+    typename proto::result_of::make_expr<lru<K>, memoize_domain, E const&>::type
+        cached(E const& e)
+    {
+        static_assert(!std::is_same<typename E::cache_type, terminal_result>::value,
+            "cached() needs an expression that caches its result");
+        return proto::make_expr<lru<K>, memoize_domain>(e);
+    }
+
+    // Builds a node whose result is computed once for all instances of the 
+    // expression's type that have equal operand values, and stored once for as 
+    // long as any of them holds it.  The expression must be an operator or eager 
+    // function call whose operands are LessThanComparable, and its operator 
+    // must depend only on the operands' values.  A callee must be a function 
+    // pointer, which is part of the key, or have no state of its own, so 
+    // std::function and capturing lambdas are rejected.
+    template <typename E>
+    typename proto::result_of::make_expr<shared_result, memoize_domain, E const&>::type
+        shared(E const& e)
+    {
+        static_assert(!std::is_same<typename E::cache_type, terminal_result>::value,
+            "shared() needs an expression that caches its result");
+        static_assert(has_stateless_callee<E>::value || has_pointer_callee<E>::value,
+            "shared() needs a function pointer or a callee without state, e.g. a lambda "
+            "that captures nothing, because instances with different callees would share results");
+        return proto::make_expr<shared_result, memoize_domain>(e);
+    }
+
+    // Builds a node that, when the expression becomes dirty, keeps returning the 
+    // result of its previous evaluation while the expression is re-evaluated on 
+    // a worker pool.  Once the new result is ready, the node becomes dirty and 
+    // the next evaluation picks it up.  Only the first evaluation waits for the 
+    // expression.  Because the expression is evaluated on a worker thread, any 
+    // inputs written concurrently should be seqlock inputs or input_group 
+    // members.
+    template <typename E>
+    typename proto::result_of::make_expr<stale_while_revalidate, memoize_domain, E const&>::type
+        stale(E const& e, worker_pool& pool = default_worker_pool())
+    {
+        typename proto::result_of::make_expr<stale_while_revalidate, memoize_domain, E const&>::type
+            node = proto::make_expr<stale_while_revalidate, memoize_domain>(e);
+        node.pool = &pool;
+        return node;
+    }
+
+    // Builds a node that gathers statistics about an expression into stats, 
+    // which must outlive it: how often the expression is read and recomputed, 
+    // and how long recomputing it takes.  Use it to find the nodes that cost 
+    // less to recompute than to cache, i.e. those for which 
+    // stats.worth_caching() is false, and hint them with recompute_always.
+    template <typename E>
+    typename proto::result_of::make_expr<profiled, memoize_domain, E const&>::type
+        profile(E const& e, node_profile& stats)
+    {
+        typename proto::result_of::make_expr<profiled, memoize_domain, E const&>::type
+            node = proto::make_expr<profiled, memoize_domain>(e);
+        node.stats = &stats;
+        return node;
+    }
+
+    // Builds a node that evaluates an expression element by element, where the 
+    // expression's operands are containers (std::vector by default, see 
+    // is_element_container) of equal size, or scalars that apply to every 
+    // element.  e.g. elementwise(in(a) + in(b) * in(k)) computes 
+    // a[i] + b[i] * k for each i in one loop, with no temporary vectors.  Only 
+    // the result of the whole expression is cached; operands that aren't 
+    // element-wise operators, such as function calls, are evaluated and cached 
+    // as usual and then indexed.
+    template <typename E>
+    typename proto::result_of::make_expr<fused, memoize_domain, E const&>::type
+        elementwise(E const& e)
+    {
+        return proto::make_expr<fused, memoize_domain>(e);
+    }
+
+    // Builds a node reducing the last window samples of a ring_buffer input, 
+    // updated for each new sample without rescanning the window.  The window 
+    // is limited to the buffer's capacity.
+    template <typename Kind, typename E>
+    typename proto::result_of::make_expr<windowed<Kind>, memoize_domain, E const&>::type
+        moving(E const& e, std::size_t window)
+    {
+        typename proto::result_of::make_expr<windowed<Kind>, memoize_domain, E const&>::type
+            node = proto::make_expr<windowed<Kind>, memoize_domain>(e);
+        node.window = window;
+        return node;
+    }
+
+    template <typename E>
+    typename proto::result_of::make_expr<windowed<sum_op>, memoize_domain, E const&>::type
+        moving_sum(E const& e, std::size_t window)
+    {
+        return moving<sum_op>(e, window);
+    }
+
+    // The average of the samples in the window, as a double for arithmetic 
+    // samples.
+    template <typename E>
+    typename proto::result_of::make_expr<windowed<mean_op>, memoize_domain, E const&>::type
+        moving_average(E const& e, std::size_t window)
+    {
+        return moving<mean_op>(e, window);
+    }
+
+    template <typename E>
+    typename proto::result_of::make_expr<windowed<min_op>, memoize_domain, E const&>::type
+        moving_min(E const& e, std::size_t window)
+    {
+        return moving<min_op>(e, window);
+    }
+
+    template <typename E>
+    typename proto::result_of::make_expr<windowed<max_op>, memoize_domain, E const&>::type
+        moving_max(E const& e, std::size_t window)
+    {
+        return moving<max_op>(e, window);
+    }
+
+    // Builds a node reducing a container with op.  When the container is a 
+    // tracked_vector input, the node updates in proportion to the number of 
+    // elements changed, and otherwise it reduces the whole container whenever 
+    // it changes.
+    template <typename Op, typename E>
+    typename proto::result_of::make_expr<aggregate<Op>, memoize_domain, E const&, function<Op> >::type
+        reduce(E const& e, Op const& op)
+    {
+        return proto::make_expr<aggregate<Op>, memoize_domain>(e, function<Op>(op));
+    }
+
+    // A vector of f applied to each element of a container.  When the 
+    // container is a tracked_vector input, f is only applied to the elements 
+    // that were changed or inserted since the last evaluation.
+    template <typename E, typename F>
+    typename proto::result_of::make_expr<mapped, memoize_domain, E const&, function<F> >::type
+        transform(E const& e, F f)
+    {
+        return proto::make_expr<mapped, memoize_domain>(e, function<F>(f));
+    }
+
+    // A vector of the elements of a container that satisfy predicate, in 
+    // order.  When the container is a tracked_vector input, predicate is only 
+    // applied to the elements that were changed or inserted since the last 
+    // evaluation, and the result is rebuilt from the first change on.
+    template <typename E, typename Predicate>
+    typename proto::result_of::make_expr<filtered, memoize_domain, E const&, function<Predicate> >::type
+        filter(E const& e, Predicate predicate)
+    {
+        return proto::make_expr<filtered, memoize_domain>(e, function<Predicate>(predicate));
+    }
+
+    // The sum of a container's elements.
+    template <typename E>
+    typename proto::result_of::make_expr<aggregate<sum_op>, memoize_domain, E const&, function<sum_op> >::type
+        sum(E const& e)
+    {
+        return reduce(e, sum_op());
+    }
+
+    // The number of a container's elements satisfying predicate.
+    template <typename E, typename Predicate>
+    typename proto::result_of::make_expr<
+        aggregate<count_if_op<Predicate> >, memoize_domain, E const&, function<count_if_op<Predicate> > >::type
+        count_if(E const& e, Predicate predicate)
+    {
+        return reduce(e, count_if_op<Predicate>{ predicate });
+    }
+
+    // The least of a container's elements, which must be of an arithmetic type.  
+    // The least of no elements is the type's maximum.
+    template <typename E>
+    typename proto::result_of::make_expr<aggregate<min_op>, memoize_domain, E const&, function<min_op> >::type
+        minimum(E const& e)
+    {
+        return reduce(e, min_op());
+    }
+
+    // The greatest of a container's elements, which must be of an arithmetic 
+    // type.  The greatest of no elements is the type's lowest value.
+    template <typename E>
+    typename proto::result_of::make_expr<aggregate<max_op>, memoize_domain, E const&, function<max_op> >::type
+        maximum(E const& e)
+    {
+        return reduce(e, max_op());
+    }
+
+    template <typename Op, typename... E>
+    struct nary_of
+    {
+        typedef nary<Op, typename std::decay<
+            typename proto::result_of::as_expr<E const, memoize_domain>::type>::type...> value_type;
+        typedef typename proto::result_of::as_expr<value_type, memoize_domain>::type type;
+
+        static type make(Op const& op, E const&... e)
+        {
+            return proto::as_expr<memoize_domain>(value_type(op, proto::as_expr<memoize_domain>(e)...));
+        }
+    };
+
+    // Builds a node whose result is the sum of any number of expressions, e.g. 
+    // sum_of(in(a), in(b), in(c), in(d)) rather than in(a) + in(b) + in(c) + 
+    // in(d), which nests a type and keeps a result for each +.
+    template <typename... E>
+    typename nary_of<sum_op, E...>::type
+        sum_of(E const&... e)
+    {
+        return nary_of<sum_op, E...>::make(sum_op(), e...);
+    }
+
+    // Builds a node whose result is the least of any number of expressions.
+    template <typename... E>
+    typename nary_of<min_op, E...>::type
+        min_of(E const&... e)
+    {
+        return nary_of<min_op, E...>::make(min_op(), e...);
+    }
+
+    // Builds a node whose result is the greatest of any number of expressions.
+    template <typename... E>
+    typename nary_of<max_op, E...>::type
+        max_of(E const&... e)
+    {
+        return nary_of<max_op, E...>::make(max_op(), e...);
+    }
+
+    // Builds a constant terminal, for expressions that combine constants before 
+    // any input, e.g. constant(2) * 3 + in(x), where the product is folded.
+    template <typename T>
+    typename proto::result_of::as_expr<T, memoize_domain>::type
+        constant(T const& value)
+    {
+        return proto::as_expr<memoize_domain>(value);
+    }
+
+    template <typename F>
+    typename proto::result_of::as_expr<function<F>, memoize_domain>::type
+        fn(F f)
+    {
+        return proto::as_expr<memoize_domain>(function<F>(f));
+    }
+
+    template <typename R, typename F>
+    typename proto::result_of::as_expr<into_function<R, F>, memoize_domain>::type
+        fn_into(F f)
+    {
+        return proto::as_expr<memoize_domain>(into_function<R, F>(f));
+    }
+
+    template <typename F>
+    typename proto::result_of::as_expr<lazy_function<F>, memoize_domain>::type
+        lazy(F f)
+    {
+        return proto::as_expr<memoize_domain>(lazy_function<F>(f));
+    }
+
+    // This context marks dirty all sub-expressions who depend on terminals 
+    // that are dirty.  Derived is the context actually used, which is passed 
+    // to every node, and EvalContext the context that evaluates what it marks.
+    template <typename Derived, typename EvalContext>
+    struct basic_mark_context
+    {
+        typedef EvalContext eval_context;
+
+        template <
+            typename Expr,
+            typename Tag = typename node_tag<Expr>::type>
+        struct eval
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                // Mark child expressions, and if any are dirty mark this expression as 
+                // dirty too.  Children are marked even if this expression is already 
+                // dirty, because it may have been skipped by an enclosing conditional 
+                // while its children's inputs changed.
+                return e.dirty = fusion::fold(e, e.dirty,
+                    std::bind(std::logical_or<bool>(), std::placeholders::_1,
+                    std::bind(proto::functional::eval(), std::placeholders::_2, ctx)));
+            }
+        };
+
+        // Conditional expressions depend on their condition and on the branch 
+        // taken during the last evaluation.  The other branch is marked by 
+        // eval_cache_context if and when the condition selects it.
+        template <typename Expr>
+        struct eval_conditional
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                bool dirty = proto::eval(proto::child_c<0>(e), ctx);
+                if (e.branch == 1) dirty = proto::eval(proto::child_c<1>(e), ctx) || dirty;
+                mark_else(e, ctx, dirty, mpl::bool_<proto::arity_of<Expr>::value == 3>());
+                return e.dirty = e.dirty || dirty;
+            }
+
+        private:
+            static void mark_else(Expr& e, Derived const& ctx, bool& dirty, mpl::true_)
+            {
+                if (e.branch == 2) dirty = proto::eval(proto::child_c<2>(e), ctx) || dirty;
+            }
+
+            static void mark_else(Expr&, Derived const&, bool&, mpl::false_)
+            {
+            }
+        };
+
+        template <typename Expr>
+        struct eval < Expr, proto::tag::if_else_ > : eval_conditional < Expr > {};
+
+        template <typename Expr>
+        struct eval < Expr, proto::tag::logical_and > : eval_conditional < Expr > {};
+
+        template <typename Expr>
+        struct eval < Expr, proto::tag::logical_or > : eval_conditional < Expr > {};
+
+        // Lazy function calls depend on the arguments they read during their 
+        // last evaluation.  Any other argument is marked by lazy_arg if and when 
+        // it is read.
+        template <typename Expr>
+        struct eval < Expr, lazy_call >
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                bool dirty = mark_reads(e, ctx,
+                    std::make_index_sequence<proto::arity_of<Expr>::value - 1>());
+                return e.dirty = e.dirty || dirty;
+            }
+
+        private:
+            template <std::size_t... I>
+            static bool mark_reads(Expr& e, Derived const& ctx, std::index_sequence<I...>)
+            {
+                bool dirty = false;
+                bool marked[] = { false, ((e.reads & (1ul << (I + 1))) &&
+                    (dirty = proto::eval(proto::child_c<I + 1>(e), ctx) || dirty))... };
+                (void)marked;
+                return dirty;
+            }
+        };
+
+        // A stale-while-revalidate node is clean while its job runs, and dirty 
+        // once the job is done.  Otherwise a dirty child starts a new job, unless 
+        // there is no previous result to serve.
+        template <typename Expr>
+        struct eval < Expr, stale_while_revalidate >
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                switch (e.status.load(std::memory_order_acquire))
+                {
+                case Expr::running: return e.dirty = false;
+                case Expr::done: return e.dirty = true;
+                }
+
+                if (proto::eval(proto::child_c<0>(e), ctx) && !e.dirty)
+                    revalidate<EvalContext>(e);
+                return e.dirty;
+            }
+        };
+
+        template <
+            typename Expr,
+            typename Value = typename terminal_kind<typename proto::result_of::value<Expr>::type>::type>
+        struct mark_terminal
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                return e.dirty = !Expr::policies::same(value.cache, value.src);
+            }
+        };
+
+        // An n-ary node marks all of its children, and is dirty if any of them 
+        // is.  Like other non-terminals, it stays dirty until it is evaluated.
+        template <typename Expr, typename Op, typename... E>
+        struct mark_terminal < Expr, nary<Op, E...> >
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                return e.dirty = mark_children(proto::value(e), ctx, std::index_sequence_for<E...>()) || e.dirty;
+            }
+
+        private:
+            template <std::size_t... I>
+            static bool mark_children(nary<Op, E...> const& value, Derived const& ctx, std::index_sequence<I...>)
+            {
+                bool dirty = false;
+                bool marked[] = { false, (dirty = proto::eval(std::get<I>(value.children), ctx) || dirty)... };
+                (void)marked;
+                return dirty;
+            }
+        };
+
+        template <typename Expr, typename T>
+        struct mark_terminal < Expr, constant_terminal<T> >
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                return e.dirty = false;
+            }
+        };
+
+        template <typename Expr, typename T>
+        struct mark_terminal < Expr, input<seqlock<T> > >
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                if (value.src.version() != value.version)
+                    value.snapshot = value.src.load(value.version);
+                return e.dirty = !Expr::policies::same(value.cache, value.snapshot);
+            }
+        };
+
+        template <typename Expr, typename T, typename M>
+        struct mark_terminal < Expr, input<group_member<T, M> > >
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                T const& snapshot = value.src.group.snapshot();
+                if (value.version == value.src.group.version()) return e.dirty = false;
+                if (Expr::policies::same(value.cache, snapshot.*value.src.member))
+                {
+                    value.version = value.src.group.version();
+                    return e.dirty = false;
+                }
+                return e.dirty = true;
+            }
+        };
+
+        template <typename Expr, typename T, typename D>
+        struct mark_terminal < Expr, input<std::unique_ptr<T, D> > >
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                return e.dirty = value.cache != value.src.get();
+            }
+        };
+
+        // A hashed_array's changes stay dirty until they are evaluated, even if 
+        // the array is marked again first.
+        template <typename Expr, typename T>
+        struct mark_terminal < Expr, input<hashed_array<T> > >
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                return e.dirty = proto::value(e).cache.rehash() || e.dirty;
+            }
+        };
+
+        template <typename Expr, typename T, typename Policy>
+        struct mark_terminal < Expr, input<approximate<T, Policy> > >
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                return e.dirty = !value.primed || !value.src.policy.same(value.cache, value.src.value);
+            }
+        };
+
+        template <typename Expr, typename T>
+        struct mark_terminal < Expr, input<ring_buffer<T> > >
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                return e.dirty = value.count != value.src.count();
+            }
+        };
+
+        template <typename Expr, typename T>
+        struct mark_terminal < Expr, input<tracked_vector<T> > >
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                return e.dirty = value.version != value.src.version();
+            }
+        };
+
+        template <typename Expr, typename Owner, typename T>
+        struct mark_terminal < Expr, input<owner_member<Owner, T> > >
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                return e.dirty = !Expr::policies::same(value.cache, value.src.owner->*value.src.member);
+            }
+        };
+
+        template <typename Expr, typename F>
+        struct mark_terminal < Expr, function<F> >
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                return e.dirty = false;
+            }
+        };
+
+        template <typename Expr, typename R, typename F>
+        struct mark_terminal < Expr, into_function<R, F> >
+        {
+            typedef bool result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                return e.dirty = false;
+            }
+        };
+
+        template <typename Expr>
+        struct eval < Expr, proto::tag::terminal >
+            : mark_terminal < Expr >
+        {
+        };
+    };
+
+    struct mark_dirty_context
+        : basic_mark_context < mark_dirty_context, eval_cache_context >
+    {
+    };
+
+    // The argument passed to a lazy function for child N of the call 
+    // expression.  Calling get() evaluates the argument and records that the 
+    // call read it.  An argument that wasn't read by the previous evaluation 
+    // was skipped by mark_dirty_context, so it is marked before it is 
+    // evaluated.
+    template <typename Expr, int N, typename Context>
+    class lazy_arg
+    {
+    public:
+        typedef typename std::remove_reference<
+            typename proto::result_of::child_c<Expr&, N>::type>::type child_type;
+        typedef typename proto::result_of::eval<child_type, Context const>::type result_type;
+
+        lazy_arg(Expr& e, Context const& ctx, unsigned long previous_reads)
+            : _e(e), _ctx(ctx), _previous_reads(previous_reads)
+        {
+        }
+
+        result_type get() const
+        {
+            const unsigned long bit = 1ul << N;
+            if (!((_previous_reads | _e.reads) & bit))
+                proto::eval(proto::child_c<N>(_e), typename Context::mark_context());
+            _e.reads |= bit;
+            return proto::eval(proto::child_c<N>(_e), _ctx);
+        }
+
+        result_type operator*() const { return get(); }
+
+    private:
+        Expr& _e;
+        Context const& _ctx;
+        unsigned long _previous_reads;
+    };
+
+    // This context evalutes an expression by re-evaluating any sub-expressions 
+    // that are dirty, and returning the cached result.  Derived is the context 
+    // actually used, which is passed to every node, and MarkContext the 
+    // context that marks the branches and lazy arguments it comes across.
+    template <typename Derived, typename MarkContext>
+    struct basic_eval_context
+    {
+        typedef MarkContext mark_context;
+
+        template <
+            typename Expr,
+            typename Tag = typename node_tag<Expr>::type>
+        struct eval
+            : proto::default_eval < Expr, Derived const >
+        {
+            typedef proto::default_eval<Expr, Derived const> base_type;
+            typedef typename std::decay<typename base_type::result_type>::type value_type;
+            typedef is_recomputed<typename Expr::proto_domain::policies, Tag, value_type> recomputed;
+            typedef typename std::conditional<recomputed::value, value_type, value_type const&>::type result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                return evaluate(e, ctx, recomputed());
+            }
+
+        private:
+            result_type evaluate(Expr& e, Derived const& ctx, std::false_type)
+            {
+                if (e.dirty)
+                {
+                    e.result = base_type::operator()(e, ctx);
+                    e.dirty = false;
+                }
+                return e.result;
+            }
+
+            result_type evaluate(Expr& e, Derived const& ctx, std::true_type)
+            {
+                e.dirty = false;
+                return base_type::operator()(e, ctx);
+            }
+        };
+
+        // Evaluates child N of a conditional expression, which becomes the 
+        // branch it depends on.  If a different branch was taken last time, this 
+        // one was skipped by mark_dirty_context and must be marked first.
+        template <int N, typename Expr>
+        static typename proto::result_of::eval<
+            typename std::remove_reference<typename proto::result_of::child_c<Expr&, N>::type>::type,
+            Derived const>::type
+            eval_branch(Expr& e, Derived const& ctx)
+        {
+            if (e.branch != N)
+            {
+                proto::eval(proto::child_c<N>(e), MarkContext());
+                e.branch = N;
+            }
+            return proto::eval(proto::child_c<N>(e), ctx);
+        }
+
+        template <typename Expr>
+        struct eval < Expr, proto::tag::if_else_ >
+            : proto::default_eval < Expr, Derived const >
+        {
+            typedef proto::default_eval<Expr, Derived const> base_type;
+            typedef typename std::decay<typename base_type::result_type>::type const& result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                if (e.dirty)
+                {
+                    if (proto::eval(proto::child_c<0>(e), ctx))
+                        e.result = eval_branch<1>(e, ctx);
+                    else
+                        e.result = eval_branch<2>(e, ctx);
+                    e.dirty = false;
+                }
+                return e.result;
+            }
+        };
+
+        // && and || only evaluate (and depend on) their right-hand side when the 
+        // left-hand side doesn't already determine the result.
+        template <typename Expr, bool ShortCircuitValue>
+        struct eval_short_circuit
+            : proto::default_eval < Expr, Derived const >
+        {
+            typedef proto::default_eval<Expr, Derived const> base_type;
+            typedef typename std::decay<typename base_type::result_type>::type const& result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                if (e.dirty)
+                {
+                    if (static_cast<bool>(proto::eval(proto::child_c<0>(e), ctx)) == ShortCircuitValue)
+                    {
+                        e.result = ShortCircuitValue;
+                        e.branch = 0;
+                    }
+                    else
+                    {
+                        e.result = static_cast<bool>(eval_branch<1>(e, ctx));
+                    }
+                    e.dirty = false;
+                }
+                return e.result;
+            }
+        };
+
+        template <typename Expr>
+        struct eval < Expr, proto::tag::logical_and >
+            : eval_short_circuit < Expr, false >
+        {
+        };
+
+        template <typename Expr>
+        struct eval < Expr, proto::tag::logical_or >
+            : eval_short_circuit < Expr, true >
+        {
+        };
+
+        // Function calls evaluate the callee and all of the arguments, as 
+        // proto::default_eval does, but determine the result type with decltype 
+        // so that the callee may be a lambda.
+        template <typename Expr>
+        struct eval < Expr, proto::tag::function >
+        {
+        private:
+            typedef std::make_index_sequence<proto::arity_of<Expr>::value - 1> indices;
+
+            template <std::size_t... I>
+            static auto call(Expr& e, Derived const& ctx, std::index_sequence<I...>)
+                -> decltype(proto::eval(proto::child_c<0>(e), ctx)(proto::eval(proto::child_c<I + 1>(e), ctx)...))
+            {
+                return proto::eval(proto::child_c<0>(e), ctx)(proto::eval(proto::child_c<I + 1>(e), ctx)...);
+            }
+
+        public:
+            typedef typename std::decay<decltype(call(std::declval<Expr&>(),
+                std::declval<Derived const&>(), indices()))>::type value_type;
+            typedef is_recomputed<typename Expr::proto_domain::policies, proto::tag::function, value_type> recomputed;
+            typedef typename std::conditional<recomputed::value, value_type, value_type const&>::type result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                return evaluate(e, ctx, recomputed());
+            }
+
+        private:
+            static result_type evaluate(Expr& e, Derived const& ctx, std::false_type)
+            {
+                if (e.dirty)
+                {
+                    e.result = call(e, ctx, indices());
+                    e.dirty = false;
+                }
+                return e.result;
+            }
+
+            static result_type evaluate(Expr& e, Derived const& ctx, std::true_type)
+            {
+                e.dirty = false;
+                return call(e, ctx, indices());
+            }
+        };
+
+        // Lazy function calls pass their arguments to the callee unevaluated, 
+        // and record which ones it reads.
+        template <typename Expr>
+        struct eval < Expr, lazy_call >
+        {
+        private:
+            typedef std::make_index_sequence<proto::arity_of<Expr>::value - 1> indices;
+
+            template <std::size_t... I>
+            static auto call(Expr& e, Derived const& ctx, unsigned long previous_reads, std::index_sequence<I...>)
+                -> decltype(proto::value(proto::child_c<0>(e)).f(lazy_arg<Expr, I + 1, Derived>(e, ctx, previous_reads)...))
+            {
+                return proto::value(proto::child_c<0>(e)).f(lazy_arg<Expr, I + 1, Derived>(e, ctx, previous_reads)...);
+            }
+
+        public:
+            typedef typename std::decay<decltype(call(std::declval<Expr&>(),
+                std::declval<Derived const&>(), 0ul, indices()))>::type const& result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                if (e.dirty)
+                {
+                    const unsigned long previous_reads = e.reads;
+                    e.reads = 0;
+                    e.result = call(e, ctx, previous_reads, indices());
+                    e.dirty = false;
+                }
+                return e.result;
+            }
+        };
+
+        template <typename Expr, typename Kind>
+        struct eval < Expr, windowed<Kind> >
+        {
+            typedef typename Expr::value_type const& result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                if (e.dirty)
+                {
+                    auto const& samples = proto::eval(proto::child_c<0>(e), ctx);
+                    e.result = e.state.update(samples, std::min(e.window, samples.capacity()));
+                    e.dirty = false;
+                }
+                return e.result;
+            }
+        };
+
+        template <typename Expr, typename Op>
+        struct eval < Expr, aggregate<Op> >
+        {
+            typedef typename Expr::value_type const& result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                if (e.dirty)
+                {
+                    e.result = e.tree.update(proto::eval(proto::child_c<0>(e), ctx), proto::value(proto::child_c<1>(e)).f);
+                    e.dirty = false;
+                }
+                return e.result;
+            }
+        };
+
+        template <typename Expr>
+        struct eval < Expr, mapped >
+        {
+            typedef std::vector<typename Expr::value_type> const& result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                if (e.dirty)
+                {
+                    e.values.update(proto::eval(proto::child_c<0>(e), ctx), proto::eval(proto::child_c<1>(e), ctx));
+                    e.dirty = false;
+                }
+                return e.values.values();
+            }
+        };
+
+        template <typename Expr>
+        struct eval < Expr, filtered >
+        {
+            typedef std::vector<typename Expr::container_type::value_type> const& result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                if (e.dirty)
+                {
+                    auto const& items = proto::eval(proto::child_c<0>(e), ctx);
+                    auto const& predicate = proto::eval(proto::child_c<1>(e), ctx);
+                    const std::size_t first = e.keep.update(items, [&](typename Expr::container_type::value_type const& x)
+                    {
+                        return static_cast<bool>(predicate(x));
+                    });
+
+                    auto const& keep = e.keep.values();
+                    e.result.resize(std::count(keep.begin(), keep.begin() + first, true));
+                    for (std::size_t i = first; i < items.size(); ++i)
+                        if (keep[i]) e.result.push_back(items[i]);
+                    e.dirty = false;
+                }
+                return e.result;
+            }
+        };
+
+        // Calls to into_functions pass the callee the node's result to 
+        // overwrite, followed by the evaluated arguments.
+        template <typename Expr>
+        struct eval < Expr, into_call >
+        {
+        private:
+            typedef std::make_index_sequence<proto::arity_of<Expr>::value - 1> indices;
+
+            template <std::size_t... I>
+            static void call(Expr& e, Derived const& ctx, std::index_sequence<I...>)
+            {
+                proto::value(proto::child_c<0>(e)).f(e.result, proto::eval(proto::child_c<I + 1>(e), ctx)...);
+            }
+
+        public:
+            typedef typename callee_of<Expr>::type::result_type const& result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                if (e.dirty)
+                {
+                    call(e, ctx, indices());
+                    e.dirty = false;
+                }
+                return e.result;
+            }
+        };
+
+        // A shared() node looks its child's operands up in the shared_table, and 
+        // only evaluates the child if no instance holds a result for them.  The 
+        // child's result is then moved into the table; it is only read from 
+        // there.
+        template <typename Expr>
+        struct eval < Expr, shared_result >
+        {
+            typedef typename Expr::child_type child_type;
+            typedef typename child_type::cache_type const& result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                if (e.dirty)
+                {
+                    auto& child = proto::child_c<0>(e);
+                    auto& table = shared_table<child_type>::instance();
+                    typename Expr::key_type::type key = Expr::key_type::get(child, ctx);
+                    e.value = table.find(key);
+                    if (!e.value)
+                    {
+                        proto::eval(child, ctx);
+                        e.value = table.insert(std::move(key), std::move(child.result));
+                    }
+                    child.dirty = false;
+                    e.dirty = false;
+                }
+                return *e.value;
+            }
+        };
+
+        // When its child is dirty, a cached<K>() node evaluates the child's 
+        // operands, and only applies the child's operator if their values aren't 
+        // in the table.  The result is the child's, which isn't copied again.
+        template <typename Expr, std::size_t K>
+        struct eval < Expr, lru<K> >
+        {
+            typedef typename Expr::child_type::cache_type const& result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                auto& child = proto::child_c<0>(e);
+                if (e.dirty)
+                {
+                    if (child.dirty)
+                    {
+                        typename Expr::key_type::type key = Expr::key_type::get(child, ctx);
+                        if (auto hit = e.table.find(key))
+                        {
+                            child.result = *hit;
+                            child.dirty = false;
+                        }
+                        else
+                        {
+                            proto::eval(child, ctx);
+                            e.table.insert(std::move(key), child.result);
+                        }
+                    }
+                    e.dirty = false;
+                }
+                return child.result;
+            }
+        };
+
+        // A profile() node counts each read, and times its child's evaluation 
+        // when the child is dirty.  The child's result is passed on, not copied.
+        template <typename Expr>
+        struct eval < Expr, profiled >
+        {
+            typedef typename std::remove_reference<typename proto::result_of::child_c<Expr, 0>::type>::type child_type;
+            typedef typename proto::result_of::eval<child_type, Derived const>::type result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                auto& child = proto::child_c<0>(e);
+                node_profile& stats = *e.stats;
+                ++stats.reads;
+                e.dirty = false;
+                if (!child.dirty) return proto::eval(child, ctx);
+
+                ++stats.recomputations;
+                const node_profile::clock::time_point start = node_profile::clock::now();
+                result_type result = proto::eval(child, ctx);
+                stats.compute_time += node_profile::clock::now() - start;
+                return result;
+            }
+        };
+
+        // Picks up the result of a finished job, or evaluates the child directly 
+        // the first time.
+        template <typename Expr>
+        struct eval < Expr, stale_while_revalidate >
+        {
+            typedef typename Expr::fresh_type const& result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                if (e.dirty)
+                {
+                    if (e.status.load(std::memory_order_acquire) == Expr::done)
+                    {
+                        e.result = std::move(e.fresh);
+                        e.status.store(Expr::idle, std::memory_order_relaxed);
+                    }
+                    else
+                    {
+                        e.result = proto::eval(proto::child_c<0>(e), ctx);
+                    }
+                    e.dirty = false;
+                }
+                return e.result;
+            }
+        };
+
+        template <
+            typename Expr,
+            typename Value = typename terminal_kind<typename proto::result_of::value<Expr>::type>::type>
+        struct eval_terminal;
+
+        // An n-ary node combines its children's results in order, converted to 
+        // their common type.
+        template <typename Expr, typename Op, typename... E>
+        struct eval_terminal < Expr, nary<Op, E...> >
+        {
+            typedef typename nary<Op, E...>::value_type value_type;
+            typedef value_type const& result_type;
+
+            result_type operator()(Expr& e, Derived const& ctx)
+            {
+                auto& value = proto::value(e);
+                if (e.dirty)
+                {
+                    value.cache = combine(value, ctx, std::index_sequence_for<E...>());
+                    e.dirty = false;
+                }
+                return value.cache;
+            }
+
+        private:
+            template <std::size_t I0, std::size_t... I>
+            static value_type combine(nary<Op, E...> const& value, Derived const& ctx, std::index_sequence<I0, I...>)
+            {
+                value_type result = value.op.leaf(static_cast<value_type>(proto::eval(std::get<I0>(value.children), ctx)));
+                bool combined[] = { false, (result = value.op.combine(result,
+                    value.op.leaf(static_cast<value_type>(proto::eval(std::get<I>(value.children), ctx)))), false)... };
+                (void)combined;
+                return result;
+            }
+        };
+
+        template <typename Expr, typename T>
+        struct eval_terminal < Expr, constant_terminal<T> >
+        {
+            typedef T const& result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                return proto::value(e);
+            }
+        };
+
+        template <typename Expr, typename T>
+        struct eval_terminal < Expr, input<seqlock<T> > >
+        {
+            typedef T const& result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                if (e.dirty)
+                {
+                    value.cache = value.snapshot;
+                    e.dirty = false;
+                }
+                return value.cache;
+            }
+        };
+
+        template <typename Expr, typename T, typename M>
+        struct eval_terminal < Expr, input<group_member<T, M> > >
+        {
+            typedef M const& result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                if (e.dirty)
+                {
+                    value.cache = value.src.group.snapshot().*value.src.member;
+                    value.version = value.src.group.version();
+                    e.dirty = false;
+                }
+                return value.cache;
+            }
+        };
+
+        template <typename Expr, typename Owner, typename T>
+        struct eval_terminal < Expr, input<owner_member<Owner, T> > >
+        {
+            typedef T const& result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                if (e.dirty)
+                {
+                    value.cache = value.src.owner->*value.src.member;
+                    e.dirty = false;
+                }
+                return value.cache;
+            }
+        };
+
+        template <typename Expr, typename F>
+        struct eval_terminal < Expr, function<F> >
+        {
+            typedef F const& result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                e.dirty = false;
+                return proto::value(e).f;
+            }
+        };
+
+        template <typename Expr, typename T, typename D>
+        struct eval_terminal < Expr, input<std::unique_ptr<T, D> > >
+        {
+            typedef std::unique_ptr<T, D> const& result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                if (e.dirty)
+                {
+                    value.cache = value.src.get();
+                    e.dirty = false;
+                }
+                return value.src;
+            }
+        };
+
+        template <typename Expr, typename T>
+        struct eval_terminal < Expr, input<hashed_array<T> > >
+        {
+            typedef hashed_array<T> const& result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                e.dirty = false;
+                return proto::value(e).cache;
+            }
+        };
+
+        template <typename Expr, typename T, typename Policy>
+        struct eval_terminal < Expr, input<approximate<T, Policy> > >
+        {
+            typedef T const& result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                if (e.dirty)
+                {
+                    value.cache = value.src.value;
+                    value.primed = true;
+                    e.dirty = false;
+                }
+                return value.cache;
+            }
+        };
+
+        template <typename Expr, typename T>
+        struct eval_terminal < Expr, input<ring_buffer<T> > >
+        {
+            typedef ring_buffer<T> const& result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                value.count = value.src.count();
+                e.dirty = false;
+                return value.src;
+            }
+        };
+
+        template <typename Expr, typename T>
+        struct eval_terminal < Expr, input<tracked_vector<T> > >
+        {
+            typedef tracked_vector<T> const& result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                value.version = value.src.version();
+                e.dirty = false;
+                return value.src;
+            }
+        };
+
+        // Terminals are marked before they are evaluated, so the cache only 
+        // needs to be updated when the mark found the source changed.
+        template <typename Expr, typename T>
+        struct eval_terminal < Expr, input<T> >
+        {
+            typedef T const& result_type;
+
+            result_type operator()(Expr& e, Derived const&)
+            {
+                auto& value = proto::value(e);
+                if (e.dirty)
+                {
+                    value.cache = value.src;
+                    e.dirty = false;
+                }
+                return value.cache;
+            }
+        };
+
+        template <typename Expr>
+        struct eval <Expr, proto::tag::terminal>
+            : eval_terminal < Expr >
+        {
+        };
+    };
+
+    struct eval_cache_context
+        : basic_eval_context < eval_cache_context, mark_dirty_context >
+    {
+    };
+
+    template <typename T>
+    typename std::enable_if<!is_element_container<T>::value, T const&>::type
+        element_of(T const& value, std::size_t)
+    {
+        return value;
+    }
+
+    template <typename T>
+    typename std::enable_if<is_element_container<T>::value, typename T::const_reference>::type
+        element_of(T const& value, std::size_t i)
+    {
+        return value[i];
+    }
+
+    // Brings the operands of an element-wise expression up to date before its 
+    // loop, and finds the number of elements.  The element-wise operators in 
+    // between aren't evaluated on their own, so they are simply marked clean.
+    template <typename Context>
+    struct fused_prepare_context
+    {
+        explicit fused_prepare_context(Context const& ctx) : size(0), sized(false), eval_ctx(ctx)
+        {
+        }
+
+        template <
+            typename Expr,
+            bool Elementwise = is_elementwise<typename node_tag<Expr>::type>::value>
+        struct eval
+        {
+            typedef void result_type;
+
+            result_type operator()(Expr& e, fused_prepare_context const& ctx)
+            {
+                prepare(e, ctx, std::make_index_sequence<proto::arity_of<Expr>::value>());
+                e.dirty = false;
+            }
+
+        private:
+            template <std::size_t... I>
+            static void prepare(Expr& e, fused_prepare_context const& ctx, std::index_sequence<I...>)
+            {
+                int prepared[] = { (proto::eval(proto::child_c<I>(e), ctx), 0)... };
+                (void)prepared;
+            }
+        };
+
+        template <typename Expr>
+        struct eval < Expr, false >
+        {
+            typedef void result_type;
+
+            result_type operator()(Expr& e, fused_prepare_context const& ctx)
+            {
+                ctx.note_size(proto::eval(e, ctx.eval_ctx));
+            }
+        };
+
+        template <typename T>
+        typename std::enable_if<is_element_container<T>::value>::type
+            note_size(T const& value) const
+        {
+            if (!sized)
+            {
+                size = value.size();
+                sized = true;
+            }
+        }
+
+        template <typename T>
+        typename std::enable_if<!is_element_container<T>::value>::type
+            note_size(T const&) const
+        {
+        }
+
+        mutable std::size_t size;
+        mutable bool sized;
+        Context const& eval_ctx;
+    };
+
+    // Evaluates one element of an element-wise expression.  Operands are 
+    // already up to date, so evaluating them only returns their cached values.
+    template <typename Context>
+    struct element_context
+    {
+        element_context(std::size_t i, Context const& ctx) : index(i), eval_ctx(ctx)
+        {
+        }
+
+        template <
+            typename Expr,
+            bool Elementwise = is_elementwise<typename node_tag<Expr>::type>::value>
+        struct eval
+            : proto::default_eval < Expr, element_context const >
+        {
+        };
+
+        template <typename Expr>
+        struct eval < Expr, false >
+        {
+            typedef decltype(element_of(proto::eval(std::declval<Expr&>(),
+                std::declval<Context const&>()), 0)) result_type;
+
+            result_type operator()(Expr& e, element_context const& ctx)
+            {
+                return element_of(proto::eval(e, ctx.eval_ctx), ctx.index);
+            }
+        };
+
+        std::size_t index;
+        Context const& eval_ctx;
+    };
+
+    // Evaluates an element-wise expression into the node's previous result, 
+    // reusing its storage.
+    template <typename Derived, typename MarkContext>
+    template <typename Expr>
+    struct basic_eval_context<Derived, MarkContext>::eval < Expr, fused >
+    {
+        typedef typename std::remove_reference<
+            typename proto::result_of::child_c<Expr&, 0>::type>::type child_type;
+        typedef std::vector<typename std::decay<
+            typename proto::result_of::eval<child_type, element_context<Derived> const>::type>::type> vector_type;
+        typedef vector_type const& result_type;
+
+        result_type operator()(Expr& e, Derived const& ctx)
+        {
+            if (e.dirty)
+            {
+                auto& child = proto::child_c<0>(e);
+                fused_prepare_context<Derived> prepare(ctx);
+                proto::eval(child, prepare);
+
+                e.result.resize(prepare.size);
+                for (std::size_t i = 0; i < prepare.size; ++i)
+                    e.result[i] = proto::eval(child, element_context<Derived>(i, ctx));
+                e.dirty = false;
+            }
+            return e.result;
+        }
+    };
+
+    // Evaluates the child of a stale-while-revalidate node on its worker pool.  
+    // The child has already been marked.  If the evaluation fails the node goes 
+    // back to idle, and the still dirty child starts another job next time.
+    template <typename EvalContext, typename Expr>
+    void revalidate(Expr& e)
+    {
+        e.status.store(Expr::running, std::memory_order_relaxed);
+        e.pool->submit([&e]()
+        {
+            try
+            {
+                new_evaluation();
+                e.fresh = proto::eval(proto::child_c<0>(e), EvalContext());
+            }
+            catch (...)
+            {
+                e.finish(Expr::idle);
+                return;
+            }
+            e.finish(Expr::done);
+        });
+    }
+
+    // Brings an expression up to date and returns a reference to its cached 
+    // result (for a terminal, to the input's cached value), so that a call 
+    // that finds nothing dirty copies nothing.  The reference is valid until 
+    // the expression is next evaluated.  A recomputed expression (see 
+    // default_policies::recompute) produces its result by value instead.
+    template <typename Expr, typename Policies>
+    typename proto::result_of::eval<memoize<Expr, Policies> const, typename Policies::eval_context const>::type
+        reevaluate(memoize<Expr, Policies> const& e)
+    {
+        new_evaluation();
+        proto::eval(e, typename Policies::mark_context());
+        return proto::eval(e, typename Policies::eval_context());
+    }
+
+    // Gives the node e the policies P, e.g. with_policies<P>(in(x)) to change 
+    // how an input detects changes, or with_policies<P>(a + b) to change how 
+    // the whole expression is evaluated.  Only e itself is affected; its 
+    // children keep the policies they were built with.
+    template <typename P, typename Expr, typename Policies>
+    memoize<Expr, P> with_policies(memoize<Expr, Policies> const& e)
+    {
+        return memoize<Expr, P>(e.proto_base());
+    }
+
+    template <typename P, typename T>
+    typename proto::result_of::as_expr<input<T>, basic_memoize_domain<P> >::type
+        with_policies(input<T> const& i)
+    {
+        return proto::as_expr<basic_memoize_domain<P> >(i);
+    }
+
+    // Points the inputs bound with in(owner, &Owner::member) at a new owner.  
+    // The owner must be of the type the inputs were bound to.
+    struct rebind_context
+        : proto::callable_context < rebind_context const, proto::null_context const >
+    {
+        typedef void result_type;
+
+        explicit rebind_context(void const* owner) : owner(owner)
+        {
+        }
+
+        template <typename Owner, typename T>
+        void operator()(proto::tag::terminal, input<owner_member<Owner, T> > const& value) const
+        {
+            value.src.owner = static_cast<Owner const*>(owner);
+        }
+
+        template <typename Op, typename... E>
+        void operator()(proto::tag::terminal, nary<Op, E...> const& value) const
+        {
+            rebind_children(value, std::index_sequence_for<E...>());
+        }
+
+        void const* owner;
+
+    private:
+        template <typename Op, typename... E, std::size_t... I>
+        void rebind_children(nary<Op, E...> const& value, std::index_sequence<I...>) const
+        {
+            bool rebound[] = { false, (proto::eval(std::get<I>(value.children), *this), false)... };
+            (void)rebound;
+        }
+    };
+
+    // Call from the owner's copy and move constructors and assignment operators, 
+    // after copying the expression, so that it reads the new owner's members.
+    template <typename Expr, typename Policies, typename Owner>
+    void rebind(memoize<Expr, Policies> const& e, Owner const& owner)
+    {
+        proto::eval(e, rebind_context(&owner));
+    }
+
+#ifdef MEMOIZE_HAS_COROUTINES
+
+    // A lazily started coroutine producing a T.  Awaiting a task starts it, and 
+    // resumes the awaiting coroutine when the task completes, on whichever 
+    // thread completed it.
+    template <typename T = void>
+    class task;
+
+    struct task_promise_base
+    {
+        struct final_awaiter
+        {
+            bool await_ready() noexcept { return false; }
+
+            template <typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+            {
+                std::coroutine_handle<> continuation = h.promise().continuation;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        final_awaiter final_suspend() noexcept { return {}; }
+
+        std::coroutine_handle<> continuation;
+    };
+
+    template <typename T>
+    struct task_promise : task_promise_base
+    {
+        task<T> get_return_object();
+
+        template <typename U>
+        void return_value(U&& value) { result.template emplace<1>(std::forward<U>(value)); }
+
+        void unhandled_exception() { result.template emplace<2>(std::current_exception()); }
+
+        T get()
+        {
+            if (result.index() == 2) std::rethrow_exception(std::get<2>(result));
+            return std::move(std::get<1>(result));
+        }
+
+        std::variant<std::monostate, T, std::exception_ptr> result;
+    };
+
+    // A task producing a reference keeps a pointer to the referenced object, 
+    // which must outlive the task.
+    template <typename T>
+    struct task_promise<T&> : task_promise_base
+    {
+        task<T&> get_return_object();
+
+        void return_value(T& value) { result.template emplace<1>(&value); }
+
+        void unhandled_exception() { result.template emplace<2>(std::current_exception()); }
+
+        T& get()
+        {
+            if (result.index() == 2) std::rethrow_exception(std::get<2>(result));
+            return *std::get<1>(result);
+        }
+
+        std::variant<std::monostate, T*, std::exception_ptr> result;
+    };
+
+    template <>
+    struct task_promise<void> : task_promise_base
+    {
+        task<void> get_return_object();
+
+        void return_void() {}
+
+        void unhandled_exception() { error = std::current_exception(); }
+
+        void get()
+        {
+            if (error) std::rethrow_exception(error);
+        }
+
+        std::exception_ptr error;
+    };
+
+    template <typename T>
+    class task
+    {
+    public:
+        typedef task_promise<T> promise_type;
+        typedef T value_type;
+
+        explicit task(std::coroutine_handle<promise_type> h) : _h(h) {}
+
+        task(task&& other) noexcept : _h(std::exchange(other._h, nullptr)) {}
+
+        task& operator=(task&& other) noexcept
+        {
+            if (this != &other)
+            {
+                if (_h) _h.destroy();
+                _h = std::exchange(other._h, nullptr);
+            }
+            return *this;
+        }
+
+        ~task()
+        {
+            if (_h) _h.destroy();
+        }
+
+        auto operator co_await() noexcept
+        {
+            struct awaiter
+            {
+                std::coroutine_handle<promise_type> h;
+
+                bool await_ready() noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+                {
+                    h.promise().continuation = awaiting;
+                    return h;
+                }
+
+                T await_resume() { return h.promise().get(); }
+            };
+            return awaiter{ _h };
+        }
+
+    private:
+        std::coroutine_handle<promise_type> _h;
+    };
+
+    template <typename T>
+    task<T> task_promise<T>::get_return_object()
+    {
+        return task<T>(std::coroutine_handle<task_promise<T> >::from_promise(*this));
+    }
+
+    template <typename T>
+    task<T&> task_promise<T&>::get_return_object()
+    {
+        return task<T&>(std::coroutine_handle<task_promise<T&> >::from_promise(*this));
+    }
+
+    inline task<void> task_promise<void>::get_return_object()
+    {
+        return task<void>(std::coroutine_handle<task_promise<void> >::from_promise(*this));
+    }
+
+    // A coroutine that starts immediately and frees itself when it completes, 
+    // used to start tasks from ordinary code.
+    struct detached_task
+    {
+        struct promise_type
+        {
+            detached_task get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    struct sync_wait_state
+    {
+        std::mutex mutex;
+        std::condition_variable completed;
+        bool done = false;
+        std::exception_ptr error;
+    };
+
+    template <typename T, typename Stored>
+    detached_task sync_wait_start(task<T>& t, std::variant<std::monostate, Stored>& result, sync_wait_state& state)
+    {
+        try
+        {
+            result.template emplace<1>(co_await t);
+        }
+        catch (...)
+        {
+            state.error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.done = true;
+        state.completed.notify_one();
+    }
+
+    // Runs a task and blocks the calling thread until it completes.  The task 
+    // must be able to complete without this thread's help.
+    template <typename T>
+    T sync_wait(task<T> t)
+    {
+        typedef typename std::conditional<std::is_reference<T>::value,
+            std::reference_wrapper<typename std::remove_reference<T>::type>, T>::type stored_type;
+        std::variant<std::monostate, stored_type> result;
+        sync_wait_state state;
+        sync_wait_start(t, result, state);
+
+        std::unique_lock<std::mutex> lock(state.mutex);
+        state.completed.wait(lock, [&]() { return state.done; });
+        if (state.error) std::rethrow_exception(state.error);
+        return std::move(std::get<1>(result));
+    }
+
+    // Awaits a group of tasks that run concurrently: each task is started in 
+    // turn, and whenever one suspends the next one starts.  The awaiting 
+    // coroutine is resumed by whichever task completes last, and the first 
+    // exception thrown by any of them is rethrown.
+    class when_all
+    {
+    public:
+        explicit when_all(std::vector<task<void> >& tasks) : _tasks(tasks), _remaining(0) {}
+
+        bool await_ready() const noexcept { return _tasks.empty(); }
+
+        bool await_suspend(std::coroutine_handle<> awaiting)
+        {
+            _continuation = awaiting;
+            _remaining.store(_tasks.size() + 1, std::memory_order_relaxed);
+            for (auto& t : _tasks) start(t, *this);
+            return !completed();
+        }
+
+        void await_resume()
+        {
+            if (_error) std::rethrow_exception(_error);
+        }
+
+    private:
+        static detached_task start(task<void>& t, when_all& group)
+        {
+            try
+            {
+                co_await t;
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(group._error_mutex);
+                if (!group._error) group._error = std::current_exception();
+            }
+            if (group.completed()) group._continuation.resume();
+        }
+
+        bool completed()
+        {
+            return _remaining.fetch_sub(1, std::memory_order_acq_rel) == 1;
+        }
+
+        std::vector<task<void> >& _tasks;
+        std::atomic<std::size_t> _remaining;
+        std::coroutine_handle<> _continuation;
+        std::mutex _error_mutex;
+        std::exception_ptr _error;
+    };
+
+    // Like function, except that the callable returns a task<R>, which the call 
+    // awaits.  Use async_fn() for convenience, e.g. async_fn(f)(in(a)).  
+    // co_reevaluate() awaits the call, and the calls in independent dirty 
+    // children run concurrently.  reevaluate() blocks until the call completes.
+    template <typename F>
+    struct async_function
+    {
+        F f;
+
+        async_function(F const& callable) : f(callable)
+        {
+        }
+    };
+
+    template <typename F>
+    std::ostream& operator<<(std::ostream& s, const async_function<F>& f)
+    {
+        s << "async function";
+        return s;
+    }
+
+    template <typename F>
+    struct is_constant<async_function<F> > : std::false_type {};
+
+    struct async_call {};
+
+    template <typename F>
+    struct call_tag < async_function<F> >
+    {
+        typedef async_call type;
+    };
+
+    template <typename F>
+    typename proto::result_of::as_expr<async_function<F>, memoize_domain>::type
+        async_fn(F f)
+    {
+        return proto::as_expr<memoize_domain>(async_function<F>(f));
+    }
+
+    template <typename Derived, typename EvalContext>
+    template <typename Expr, typename F>
+    struct basic_mark_context<Derived, EvalContext>::mark_terminal < Expr, async_function<F> >
+    {
+        typedef bool result_type;
+
+        result_type operator()(Expr& e, Derived const&)
+        {
+            return e.dirty = false;
+        }
+    };
+
+    template <typename Derived, typename MarkContext>
+    template <typename Expr>
+    struct basic_eval_context<Derived, MarkContext>::eval < Expr, async_call >
+    {
+        typedef std::make_index_sequence<proto::arity_of<Expr>::value - 1> indices;
+
+        template <std::size_t... I>
+        static auto call(Expr& e, Derived const& ctx, std::index_sequence<I...>)
+        {
+            return proto::value(proto::child_c<0>(e)).f(proto::eval(proto::child_c<I + 1>(e), ctx)...);
+        }
+
+        typedef typename decltype(call(std::declval<Expr&>(),
+            std::declval<Derived const&>(), indices()))::value_type const& result_type;
+
+        result_type operator()(Expr& e, Derived const& ctx)
+        {
+            if (e.dirty)
+            {
+                e.result = sync_wait(call(e, ctx, indices()));
+                e.dirty = false;
+            }
+            return e.result;
+        }
+    };
+
+    // Whether an expression contains any async calls, and so needs to be 
+    // evaluated by co_eval() rather than eval_cache_context.
+    template <
+        typename Expr,
+        typename Indices = std::make_index_sequence<proto::arity_of<Expr>::value> >
+    struct contains_async;
+
+    template <typename Expr, std::size_t... I>
+    struct contains_async < Expr, std::index_sequence<I...> >
+        : std::bool_constant <
+            std::is_same<typename node_tag<Expr>::type, async_call>::value ||
+            (false || ... || contains_async<typename std::decay<
+                typename proto::result_of::child_c<Expr, I>::type>::type>::value) >
+    {
+    };
+
+    template <typename Context, typename Expr>
+    task<void> co_eval(Expr& e, Context const& ctx, unsigned evaluation);
+
+    template <int N, typename Context, typename Expr>
+    void co_eval_child(Expr& e, Context const& ctx, unsigned evaluation, std::vector<task<void> >& tasks)
+    {
+        auto& child = proto::child_c<N>(e);
+        if constexpr (contains_async<typename std::decay<decltype(child)>::type>::value)
+            if (child.dirty) tasks.push_back(co_eval(child, ctx, evaluation));
+    }
+
+    template <typename Context, typename Expr, std::size_t... I>
+    task<void> co_eval_children(Expr& e, Context const& ctx, unsigned evaluation, std::index_sequence<I...>)
+    {
+        std::vector<task<void> > tasks;
+        (co_eval_child<I>(e, ctx, evaluation, tasks), ...);
+        co_await when_all(tasks);
+        current_evaluation() = evaluation;
+    }
+
+    // Brings child N of a conditional expression up to date, marking it first 
+    // if it wasn't the branch taken last time, as eval_cache_context does.
+    template <int N, typename Context, typename Expr>
+    task<void> co_eval_branch(Expr& e, Context const& ctx, unsigned evaluation)
+    {
+        if (e.branch != N)
+        {
+            proto::eval(proto::child_c<N>(e), typename Context::mark_context());
+            e.branch = N;
+        }
+        co_await co_eval_children(e, ctx, evaluation, std::index_sequence<N>());
+    }
+
+    // Brings a marked expression up to date like eval_cache_context, except 
+    // that async calls are awaited, and the dirty children of a node that 
+    // contain async calls are evaluated concurrently.  Once its children are up 
+    // to date, the node itself is evaluated by eval_cache_context, which then 
+    // only finds clean children.  Lazy calls and stale-while-revalidate nodes are 
+    // evaluated by eval_cache_context, blocking on any async calls below them.
+    template <typename Context, typename Expr>
+    task<void> co_eval(Expr& e, Context const& ctx, unsigned evaluation)
+    {
+        typedef typename node_tag<Expr>::type tag;
+        typedef std::make_index_sequence<proto::arity_of<Expr>::value> children;
+
+        if (!e.dirty) co_return;
+
+        if constexpr (std::is_same<tag, async_call>::value)
+        {
+            co_await co_eval_children(e, ctx, evaluation, children());
+            e.result = co_await Context::template eval<Expr>::call(
+                e, ctx, typename Context::template eval<Expr>::indices());
+            current_evaluation() = evaluation;
+            e.dirty = false;
+        }
+        else if constexpr (std::is_same<tag, proto::tag::if_else_>::value)
+        {
+            co_await co_eval_children(e, ctx, evaluation, std::index_sequence<0>());
+            if (proto::eval(proto::child_c<0>(e), ctx))
+                co_await co_eval_branch<1>(e, ctx, evaluation);
+            else
+                co_await co_eval_branch<2>(e, ctx, evaluation);
+            proto::eval(e, ctx);
+        }
+        else if constexpr (std::is_same<tag, proto::tag::logical_and>::value ||
+            std::is_same<tag, proto::tag::logical_or>::value)
+        {
+            co_await co_eval_children(e, ctx, evaluation, std::index_sequence<0>());
+            const bool lhs = static_cast<bool>(proto::eval(proto::child_c<0>(e), ctx));
+            if (lhs == std::is_same<tag, proto::tag::logical_and>::value)
+                co_await co_eval_branch<1>(e, ctx, evaluation);
+            proto::eval(e, ctx);
+        }
+        else if constexpr (std::is_same<tag, lazy_call>::value ||
+            std::is_same<tag, stale_while_revalidate>::value)
+        {
+            proto::eval(e, ctx);
+        }
+        else
+        {
+            co_await co_eval_children(e, ctx, evaluation, children());
+            proto::eval(e, ctx);
+        }
+    }
+
+    // The awaitable counterpart of reevaluate(), which likewise produces a 
+    // reference to the cached result.  The expression must stay alive until 
+    // the returned task completes.
+    template <typename Expr, typename Policies>
+    task<typename proto::result_of::eval<memoize<Expr, Policies> const, typename Policies::eval_context const>::type>
+        co_reevaluate(memoize<Expr, Policies> const& e)
+    {
+        const unsigned evaluation = new_evaluation();
+        const typename Policies::eval_context ctx = typename Policies::eval_context();
+        proto::eval(e, typename Policies::mark_context());
+        if constexpr (contains_async<memoize<Expr, Policies> >::value)
+            co_await co_eval(e, ctx, evaluation);
+        co_return proto::eval(e, ctx);
+    }
+
+#endif
+
+    // The operations on an expression that are the same for every instance of 
+    // its type.  There is one evaluator per expression type, which instances 
+    // share rather than each carrying its own copy of the code.
+    struct evaluator
+    {
+        void (*reevaluate)(void const* state);
+        void* (*copy)(void const* state);
+        void (*destroy)(void* state);
+        void (*rebind)(void* state, void const* owner);
+    };
+
+    template <typename Expr>
+    struct evaluator_of
+    {
+        static void reevaluate(void const* state)
+        {
+            ::memoize::reevaluate(*static_cast<Expr const*>(state));
+        }
+
+        static void* copy(void const* state)
+        {
+            return new Expr(*static_cast<Expr const*>(state));
+        }
+
+        static void destroy(void* state)
+        {
+            delete static_cast<Expr*>(state);
+        }
+
+        static void rebind(void* state, void const* owner)
+        {
+            proto::eval(*static_cast<Expr*>(state), rebind_context(owner));
+        }
+
+        static const evaluator value;
+    };
+
+    template <typename Expr>
+    const evaluator evaluator_of<Expr>::value = {
+        &evaluator_of<Expr>::reevaluate,
+        &evaluator_of<Expr>::copy,
+        &evaluator_of<Expr>::destroy,
+        &evaluator_of<Expr>::rebind
+    };
+
+    // An expression whose type has been erased.  Only the per-instance state 
+    // (input bindings, results and dirty flags) is stored with the instance, in 
+    // a block the size of the expression; its structure and the code that 
+    // evaluates it are shared through a pointer to the type's evaluator.  
+    // Unlike a std::function holding the expression, there is no per-instance 
+    // closure or manager, and nothing is allocated when there is no expression.
+    class flyweight
+    {
+    public:
+        flyweight() : _evaluator(nullptr), _state(nullptr)
+        {
+        }
+
+        template <typename Expr, typename Policies>
+        explicit flyweight(memoize<Expr, Policies> const& e)
+            : _evaluator(&evaluator_of<memoize<Expr, Policies> >::value), _state(new memoize<Expr, Policies>(e))
+        {
+        }
+
+        flyweight(flyweight const& other)
+            : _evaluator(other._evaluator), _state(other._state ? other._evaluator->copy(other._state) : nullptr)
+        {
+        }
+
+        flyweight(flyweight&& other) noexcept : _evaluator(other._evaluator), _state(other._state)
+        {
+            other._evaluator = nullptr;
+            other._state = nullptr;
+        }
+
+        flyweight& operator=(flyweight other) noexcept
+        {
+            std::swap(_evaluator, other._evaluator);
+            std::swap(_state, other._state);
+            return *this;
+        }
+
+        ~flyweight()
+        {
+            if (_state) _evaluator->destroy(_state);
+        }
+
+        explicit operator bool() const { return _state != nullptr; }
+
+        void reevaluate() const
+        {
+            _evaluator->reevaluate(_state);
+        }
+
+        template <typename Owner>
+        void rebind(Owner const& owner)
+        {
+            if (_state) _evaluator->rebind(_state, &owner);
+        }
+
+    private:
+        evaluator const* _evaluator;
+        void* _state;
+    };
+
+    struct renderer
+    {
+        flyweight _f;
+
+        template <typename Expr>
+        renderer& operator=(Expr& e)
+        {
+            proto::display_expr(e);
+            _f = flyweight(e);
+            return *this;
+        }
+
+        void operator()()
+        {
+            if (_f) _f.reevaluate();
+        }
+
+        template <typename Owner>
+        void rebind(Owner const& owner)
+        {
+            _f.rebind(owner);
+        }
+    };
+
+    // Passes results from one writer thread to one reader thread without either 
+    // waiting for the other.  This is a double buffer with a spare slot: the 
+    // writer fills back() and publish()es it, swapping it with the spare, and the 
+    // reader acquire()s the most recently published slot by swapping it with 
+    // front(), which it can then read until the next acquire().
+    template <typename T>
+    class result_buffer
+    {
+        static const unsigned fresh = 4;
+
+    public:
+        result_buffer() : _spare(1), _back(0), _front(2), _slots()
+        {
+        }
+
+        // Writer side.
+        T& back() { return _slots[_back]; }
+
+        void publish()
+        {
+            _back = _spare.exchange(_back | fresh, std::memory_order_acq_rel) & ~fresh;
+        }
+
+        // Reader side.  Returns true if a result was published since the last 
+        // call.
+        bool acquire()
+        {
+            if (!(_spare.load(std::memory_order_relaxed) & fresh)) return false;
+            _front = _spare.exchange(_front, std::memory_order_acq_rel) & ~fresh;
+            return true;
+        }
+
+        T const& front() const { return _slots[_front]; }
+
+    private:
+        std::atomic<unsigned> _spare;
+        unsigned _back;
+        unsigned _front;
+        T _slots[3];
+    };
+
+    // Evaluates a copy of an expression on a worker_pool, so that expensive 
+    // re-evaluation doesn't stall the thread that uses the result.  request() 
+    // asks for the result to be brought up to date and returns immediately, 
+    // and update() picks up the most recent complete result, which result() 
+    // then returns.  At most one job per evaluator runs at a time, and requests 
+    // made while it runs are served by one more evaluation.  An evaluation that 
+    // throws leaves the result as it was.  Because the inputs are read on the 
+    // pool's threads, any that are written concurrently should be seqlock 
+    // inputs or input_group members.
+    template <typename R>
+    class async_evaluator
+    {
+    public:
+        template <typename Expr>
+        explicit async_evaluator(Expr const& e, worker_pool& pool = default_worker_pool())
+            : _evaluate([=]() { return reevaluate(e); }), _pool(pool), _requested(false), _running(false)
+        {
+            request();
+        }
+
+        // Waits for a running job, which refers to the evaluator.
+        ~async_evaluator()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _idle.wait(lock, [this]() { return !_running; });
+        }
+
+        async_evaluator(async_evaluator const&) = delete;
+        async_evaluator& operator=(async_evaluator const&) = delete;
+
+        void request()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_running)
+            {
+                _requested = true;
+                return;
+            }
+            _running = true;
+            _pool.submit([this]() { run(); });
+        }
+
+        // Returns true if a new result was picked up.
+        bool update() { return _results.acquire(); }
+
+        R const& result() const { return _results.front(); }
+
+    private:
+        void run()
+        {
+            for (;;)
+            {
+                try
+                {
+                    _results.back() = _evaluate();
+                    _results.publish();
+                }
+                catch (...)
+                {
+                }
+
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (!_requested)
+                {
+                    _running = false;
+                    _idle.notify_all();
+                    return;
+                }
+                _requested = false;
+            }
+        }
+
+        std::function<R()> _evaluate;
+        result_buffer<R> _results;
+        worker_pool& _pool;
+        std::mutex _mutex;
+        std::condition_variable _idle;
+        bool _requested;
+        bool _running;
+    };
+
+    struct ui_element
+    {
+        int i1, i2, i3;
+        renderer _renderer;
+
+        ui_element()
+        {
+            _renderer = (in(*this, &ui_element::i1) + in(*this, &ui_element::i2) + in(*this, &ui_element::i3));
+            i1 = 1;
+            i2 = 11;
+            i3 = 111;
+        }
+
+        ui_element(ui_element const& other)
+            : i1(other.i1), i2(other.i2), i3(other.i3), _renderer(other._renderer)
+        {
+            _renderer.rebind(*this);
+        }
+
+        ui_element& operator=(ui_element const& other)
+        {
+            i1 = other.i1;
+            i2 = other.i2;
+            i3 = other.i3;
+            _renderer = other._renderer;
+            _renderer.rebind(*this);
+            return *this;
+        }
+
+        ui_element(ui_element&& other) noexcept
+            : i1(other.i1), i2(other.i2), i3(other.i3), _renderer(std::move(other._renderer))
+        {
+            _renderer.rebind(*this);
+        }
+
+        ui_element& operator=(ui_element&& other) noexcept
+        {
+            i1 = other.i1;
+            i2 = other.i2;
+            i3 = other.i3;
+            _renderer = std::move(other._renderer);
+            _renderer.rebind(*this);
+            return *this;
+        }
+
+        void render() { _renderer(); }
+    };
+}
+
+#endif // MEMOIZE_LITE
+
+#ifdef MEMOIZE_HAS_LITE
+
+// A lightweight expression-template backend with the same in(), fn() and 
+// reevaluate() semantics as the Boost.Proto one, for code that only needs 
+// operators and eager function calls.  Each node is a plain struct: an 
+// operator or call is a node<F, C...> holding its children in a tuple, so a 
+// new expression shape instantiates one small class rather than proto's 
+// expression, domain and context machinery.  The MEMOIZE_BENCHMARK build 
+// below compiles in about 11 s rather than 28 s with g++ -O2, but the binary 
+// isn't smaller at -O2: GCC inlines each shape's evaluation completely, 
+// giving 96 KB of code rather than proto's 76 KB.  At -Os (78 KB rather than 
+// 98 KB) and -O0 it is smaller.  Conditionals, lazy and async calls and the 
+// other node kinds are only available with Boost.Proto.
+namespace memoize
+{
+    namespace lite
+    {
+        // Base of every node, which the operators below are restricted to.
+        struct node_base {};
+
+        template <typename T>
+        constexpr bool is_node = std::is_base_of<node_base, T>::value;
+
+        // An input caches the value of its source, and is dirty when the source 
+        // is no longer equal to the cached value.  Use in() for convenience.
+        template <typename T>
+        struct input : node_base
+        {
+            explicit input(T const& src) : src(&src), cache(), dirty(true)
+            {
+            }
+
+            bool mark() const
+            {
+                return dirty = !(cache == *src);
+            }
+
+            T const& eval() const
+            {
+                if (dirty)
+                {
+                    cache = *src;
+                    dirty = false;
+                }
+                return cache;
+            }
+
+            T const* src;
+            mutable T cache;
+            mutable bool dirty;
+        };
+
+        // A constant operand, such as the 2 in in(x) * 2, is never dirty.
+        template <typename T>
+        struct constant : node_base
+        {
+            explicit constant(T const& value) : value(value)
+            {
+            }
+
+            bool mark() const
+            {
+                return false;
+            }
+
+            T const& eval() const
+            {
+                return value;
+            }
+
+            T value;
+        };
+
+        // Applies f to the results of its children and caches the result.  As 
+        // with mark_dirty_context, children are marked even if the node is 
+        // already dirty, and the node stays dirty until it is evaluated.
+        template <typename F, typename... C>
+        struct node : node_base
+        {
+            typedef typename std::decay<decltype(std::declval<F const&>()(
+                std::declval<C const&>().eval()...))>::type value_type;
+
+            node(F const& f, C const&... c) : f(f), children(c...), result(), dirty(true)
+            {
+            }
+
+            bool mark() const
+            {
+                const bool marked = std::apply([](C const&... c) { return (false | ... | c.mark()); }, children);
+                return dirty = dirty || marked;
+            }
+
+            value_type const& eval() const
+            {
+                if (dirty)
+                {
+                    result = std::apply([this](C const&... c) { return f(c.eval()...); }, children);
+                    dirty = false;
+                }
+                return result;
+            }
+
+            F f;
+            std::tuple<C...> children;
+            mutable value_type result;
+            mutable bool dirty;
+        };
+
+        template <typename T>
+        auto as_node(T const& operand)
+        {
+            if constexpr (is_node<T>)
+                return operand;
+            else
+                return constant<T>(operand);
+        }
+
+        template <typename T>
+        input<T> in(T const& src)
+        {
+            return input<T>(src);
+        }
+
+        // An input only points to its source, so the source can't be a
+        // temporary that is gone before the expression is evaluated.
+        template <typename T>
+        input<T> in(T const&& src) = delete;
+
+        template <typename F>
+        struct function
+        {
+            template <typename... A>
+            node<F, decltype(as_node(std::declval<A const&>()))...> operator()(A const&... a) const
+            {
+                return { f, as_node(a)... };
+            }
+
+            F f;
+        };
+
+        template <typename F>
+        function<F> fn(F f)
+        {
+            return { f };
+        }
+
+        template <typename E, typename = std::enable_if_t<is_node<E> > >
+        decltype(auto) reevaluate(E const& e)
+        {
+            e.mark();
+            return e.eval();
+        }
+
+#define MEMOIZE_LITE_UNARY(op, F) \
+        template <typename E, typename = std::enable_if_t<is_node<E> > > \
+        node<F, E> operator op(E const& e) \
+        { \
+            return { F(), e }; \
+        }
+
+#define MEMOIZE_LITE_BINARY(op, F) \
+        template <typename L, typename R, typename = std::enable_if_t<is_node<L> || is_node<R> > > \
+        node<F, decltype(as_node(std::declval<L const&>())), decltype(as_node(std::declval<R const&>()))> \
+            operator op(L const& l, R const& r) \
+        { \
+            return { F(), as_node(l), as_node(r) }; \
+        }
+
+        MEMOIZE_LITE_UNARY(-, std::negate<>)
+        MEMOIZE_LITE_UNARY(!, std::logical_not<>)
+        MEMOIZE_LITE_UNARY(~, std::bit_not<>)
+        MEMOIZE_LITE_BINARY(+, std::plus<>)
+        MEMOIZE_LITE_BINARY(-, std::minus<>)
+        MEMOIZE_LITE_BINARY(*, std::multiplies<>)
+        MEMOIZE_LITE_BINARY(/, std::divides<>)
+        MEMOIZE_LITE_BINARY(%, std::modulus<>)
+        MEMOIZE_LITE_BINARY(==, std::equal_to<>)
+        MEMOIZE_LITE_BINARY(!=, std::not_equal_to<>)
+        MEMOIZE_LITE_BINARY(<, std::less<>)
+        MEMOIZE_LITE_BINARY(>, std::greater<>)
+        MEMOIZE_LITE_BINARY(<=, std::less_equal<>)
+        MEMOIZE_LITE_BINARY(>=, std::greater_equal<>)
+        MEMOIZE_LITE_BINARY(&, std::bit_and<>)
+        MEMOIZE_LITE_BINARY(|, std::bit_or<>)
+        MEMOIZE_LITE_BINARY(^, std::bit_xor<>)
+
+#undef MEMOIZE_LITE_UNARY
+#undef MEMOIZE_LITE_BINARY
+    }
+}
+
+#endif // MEMOIZE_HAS_LITE
+
+#ifdef MEMOIZE_BENCHMARK
+
+// Compile-time and binary-size benchmark of the two backends.  Build it once 
+// with each and compare the build times and binary sizes, e.g.
+// 
+//   time g++ -std=c++17 -O2 -DMEMOIZE_BENCHMARK memoize.cpp -o proto_bench
+//   time g++ -std=c++17 -O2 -DMEMOIZE_BENCHMARK -DMEMOIZE_LITE memoize.cpp -o lite_bench
+//   size proto_bench lite_bench
+// 
+// Each of the MEMOIZE_BENCHMARK_SHAPES expressions has a type of its own, as 
+// distinct expressions in a program would.  Both builds print the same total.
+#ifndef MEMOIZE_BENCHMARK_SHAPES
+#define MEMOIZE_BENCHMARK_SHAPES 64
+#endif
+
+#ifdef MEMOIZE_LITE
+using namespace memoize::lite;
+#else
+using namespace memoize;
+#endif
+
+template <std::size_t N>
+double benchmark_shape(int& a, int& b, double& c)
+{
+    auto f = fn([](int x, double y) { return x * y + N; });
+    auto e = f(in(a) + in(b) * 2, in(c)) - in(c) / (in(a) + 1) + (in(b) % 3 == 0);
+    double total = reevaluate(e);
+    a += 1;
+    total += reevaluate(e);
+    total += reevaluate(e);
+    return total;
+}
+
+template <std::size_t... N>
+double benchmark_shapes(std::index_sequence<N...>)
+{
+    int a = 1, b = 2;
+    double c = 0.5;
+    return (0.0 + ... + benchmark_shape<N>(a, b, c));
+}
+
+#include <iostream>
+
+int main()
+{
+    std::cout << benchmark_shapes(std::make_index_sequence<MEMOIZE_BENCHMARK_SHAPES>()) << std::endl;
+    return 0;
+}
+
+#elif !defined(MEMOIZE_LITE)
+
+#include <cassert>
+
+// Checks a moving average of floating-point samples against the average of 
+// the same window summed directly, after a sample that cancels the others.
+void check_moving_average()
+{
+    memoize::ring_buffer<double> samples(4);
+    auto average = memoize::moving_average(memoize::in(samples), 4);
+    samples.push(1e17);
+    for (int i = 0; i < 1010; ++i)
+    {
+        samples.push(i < 10 ? 1.0 : 0.1);
+        double sum = 0;
+        for (std::size_t j = 0; j < samples.size(); ++j)
+            sum += samples[j];
+        const double expected = sum / samples.size();
+        assert(std::abs(memoize::reevaluate(average) - expected) <= 1e-9 * std::max(1.0, std::abs(expected)));
+    }
+}
+
+// Checks the windowed reductions against the same windows reduced directly.
+void check_windows()
+{
+    using namespace memoize;
+    ring_buffer<int> samples(8);
+    auto sum = moving_sum(in(samples), 8);
+    auto least = moving_min(in(samples), 3);
+    auto greatest = moving_max(in(samples), 3);
+    for (int i = 0; i < 100; ++i)
+    {
+        samples.push((i * 37) % 11 - 5);
+        int total = 0, low = samples[samples.size() - 1], high = low;
+        for (std::size_t j = 0; j < samples.size(); ++j)
+            total += samples[j];
+        for (std::size_t j = samples.size() - std::min<std::size_t>(3, samples.size()); j < samples.size(); ++j)
+        {
+            low = std::min(low, samples[j]);
+            high = std::max(high, samples[j]);
+        }
+        assert(reevaluate(sum) == total);
+        assert(reevaluate(least) == low && reevaluate(greatest) == high);
+    }
+}
+
+// Checks that transform() and filter() of a tracked_vector only call their 
+// function for the elements that changed.
+void check_transform_filter()
+{
+    using namespace memoize;
+    int calls = 0, tests = 0;
+    tracked_vector<int> items;
+    for (int i = 0; i < 100; ++i)
+        items.push_back(i);
+    auto squares = transform(in(items), [&calls](int x) { ++calls; return x * x; });
+    auto evens = filter(in(items), [&tests](int x) { ++tests; return x % 2 == 0; });
+    assert(reevaluate(squares).size() == 100 && calls == 100);
+    assert(reevaluate(evens).size() == 50 && tests == 100);
+    items.set(3, 4);
+    items.erase(0);
+    assert(reevaluate(squares)[2] == 16 && reevaluate(squares).size() == 99 && calls == 101);
+    assert(reevaluate(evens).size() == 50 && tests == 101);
+}
+
+int demo_layout_calls = 0;
+
+int demo_layout(int width)
+{
+    ++demo_layout_calls;
+    return width * 2;
+}
+
+int demo_wide_layout(int width)
+{
+    ++demo_layout_calls;
+    return width * 3;
+}
+
+// Checks that cached<K>() keeps results for recently seen operands, and that 
+// shared() computes a result once for equal operands and callees.
+void check_cached_shared()
+{
+    using namespace memoize;
+    int hover = 0, width = 10;
+    auto layout = cached<2>(fn(demo_layout)(in(hover) + in(width)));
+    assert(reevaluate(layout) == 20 && demo_layout_calls == 1);
+    hover = 1;
+    assert(reevaluate(layout) == 22 && demo_layout_calls == 2);
+    hover = 0;
+    assert(reevaluate(layout) == 20 && demo_layout_calls == 2);
+
+    int w1 = 5, w2 = 5;
+    auto narrow = &demo_layout, wide = &demo_wide_layout;
+    auto a = shared(fn(narrow)(in(w1)));
+    auto b = shared(fn(narrow)(in(w2)));
+    auto c = shared(fn(wide)(in(w2)));
+    assert(reevaluate(a) == 10 && demo_layout_calls == 3);
+    assert(&reevaluate(b) == &reevaluate(a) && demo_layout_calls == 3);
+    assert(reevaluate(c) == 15 && demo_layout_calls == 4);
+}
+
+// Checks that a stale() node serves its previous result while the new one 
+// is computed on the pool, and that a copy made meanwhile is consistent.
+void check_stale()
+{
+    using namespace memoize;
+    seqlock<int> a(1);
+    auto slow = [](int x) { std::this_thread::sleep_for(std::chrono::milliseconds(10)); return x * 2; };
+    auto e = stale(fn(slow)(in(a)));
+    assert(reevaluate(e) == 2);
+    a.store(5);
+    assert(reevaluate(e) == 2);
+    auto copy = e;
+    while (reevaluate(e) != 10)
+        std::this_thread::yield();
+    while (reevaluate(copy) != 10)
+        std::this_thread::yield();
+}
+
+// Checks that async_evaluator brings its result up to date on the pool.
+void check_async_evaluator()
+{
+    using namespace memoize;
+    seqlock<int> a(1), b(2);
+    async_evaluator<int> sum(in(a) + in(b));
+    while (!sum.update())
+        std::this_thread::yield();
+    assert(sum.result() == 3);
+    a.store(10);
+    sum.request();
+    while (sum.result() != 12)
+    {
+        sum.update();
+        std::this_thread::yield();
+    }
+}
+
+#ifdef MEMOIZE_HAS_COROUTINES
+
+memoize::task<int> demo_twice(int x)
+{
+    co_return x * 2;
+}
+
+// Checks that co_reevaluate() awaits async calls and caches their results.
+void check_co_reevaluate()
+{
+    using namespace memoize;
+    int a = 1, b = 2;
+    auto e = async_fn(demo_twice)(in(a)) + in(b);
+    assert(sync_wait(co_reevaluate(e)) == 4);
+    a = 3;
+    assert(sync_wait(co_reevaluate(e)) == 8);
+    b = 0;
+    assert(reevaluate(e) == 6);
+}
+
+#endif
+
+int main(int argc, char* argv[])
+{
+    int a, b, c;
+
+    check_moving_average();
+    check_windows();
+    check_transform_filter();
+    check_cached_shared();
+    check_stale();
+    check_async_evaluator();
+#ifdef MEMOIZE_HAS_COROUTINES
+    check_co_reevaluate();
+#endif
+
+    proto::display_expr(proto::as_expr(memoize::in(a))(1));
+
+    memoize::ui_element e;
+
+    e.render();
+    e.render();
+
+    e.i2 += 5;
+
+    e.render();
+
+    return 0;
+}
+
+#else
+
+#include <cassert>
+#include <iostream>
+
+// The lightweight backend's demo: a call is only made again when its 
+// arguments change.
+int main()
+{
+    using namespace memoize::lite;
+    int a = 1, b = 2, calls = 0;
+    auto f = fn([&calls](int x) { ++calls; return x * 10; });
+    auto e = f(in(a)) + in(b);
+    assert(reevaluate(e) == 12 && calls == 1);
+    b = 3;
+    assert(reevaluate(e) == 13 && calls == 1);
+    a = 2;
+    assert(reevaluate(e) == 23 && calls == 2);
+    std::cout << reevaluate(e) << std::endl;
     return 0;
 }
 
+#endif